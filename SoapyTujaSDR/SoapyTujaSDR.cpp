@@ -1,78 +1,168 @@
 #include "SoapyTujaSDR.hpp"
+#include "latencyprobe.hpp"
+#include "converters.hpp"
 #include <SoapySDR/Logger.hpp>
 #include <SoapySDR/ConverterPrimitives.hpp>
+#include <SoapySDR/Time.hpp>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <stdexcept>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <volk/volk.h>
 
 
-// TODO: write generic
-// CS32 => CF32
-static void volkCS32toCF32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
-{
-    // 2 samples per element
-    const size_t elemDepth = 2;
-    const float scaling_factor = INT32_MAX * scaler; // S32 = 2^(32-1)-1
-    
-    volk_32i_s32f_convert_32f((float*)dstBuff, (const int32_t*)srcBuff, scaling_factor,
-                              static_cast<unsigned int>(numElems * elemDepth));
-}
-
-// TODO write generic
-// CF32 => CS32
-static void volkCF32toCS32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
-{
-    // 2 samples per element
-    const size_t elemDepth = 2;
-    const float scaling_factor = INT32_MAX * scaler; // S32 = 2^(32-1)-1
-    
-    volk_32f_s32f_convert_32i((int32_t*)dstBuff, (const float*)srcBuff, scaling_factor,
-                              static_cast<unsigned int>(numElems * elemDepth));
-}
-
-// CS32 => CS16 scaler ignored
-static void volkCS32toCS16(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
-{
-    const size_t elemDepth = 2;
-    const float scaling_factor = INT16_MAX * scaler; // S16 max = 2^(16-1)-1
-    
-    volk_32f_s32f_convert_16i((int16_t*)dstBuff, (const float*)srcBuff, scaling_factor,
-                              static_cast<unsigned int>(numElems * elemDepth));
-}
-
-SoapyTujaSDR::SoapyTujaSDR(const std::string &alsa_device) :
+SoapyTujaSDR::SoapyTujaSDR(const std::string &alsa_device,
+                           const std::string &i2c_device,
+                           const int i2c_address,
+                           const rt_config_t &rt_config,
+                           const size_t rx_channels,
+                           Replay *replay) :
 d_pcm_capture_handle(nullptr),
 d_pcm_playback_handle(nullptr),
 d_converter_func_rx(nullptr),
 d_converter_func_tx(nullptr),
 d_channels(2),
-d_sample_rate(89286),
-d_periods(4),
-d_period_frames(1024),
+d_sample_rate(replay ? replay->sampleRate() : 89286),
 d_center_frequency(0),
 d_alsa_device(alsa_device),
-d_tuja(NULL)
+d_native_rx(false),
+d_native_tx(false),
+d_mmap_rx(false),
+d_mmap_tx(false),
+d_direct_rx(false),
+d_direct_tx(false),
+d_mmap_offset_rx(0),
+d_mmap_frames_rx(0),
+d_mmap_offset_tx(0),
+d_mmap_frames_tx(0),
+d_threaded_rx(false),
+d_threaded_tx(false),
+d_engine_running(false),
+d_engine_rx(false),
+d_engine_tx(false),
+d_engine_idle_tx(false),
+d_engine_event(-1),
+d_overflow_rx(false),
+d_underflow_tx(false),
+d_sample_index_rx(0),
+d_anchor_rx(),
+d_anchored_rx(false),
+d_need_anchor_rx(true),
+d_engine_anchor_rx(),
+d_engine_anchored_rx(false),
+d_engine_need_anchor_rx(true),
+d_anchor_pending_rx(false),
+d_link_tx(false),
+d_fill_tx(false),
+d_prefill_tx(0),
+d_linked(false),
+d_active_rx(false),
+d_active_tx(false),
+d_latency(-1),
+d_record_format("CS32"),
+d_num_channels_rx(rx_channels),
+d_stream_channels_rx(1, 0),
+d_decimation_rx(1),
+d_bb_frequency_rx(rx_channels, 0),
+d_dc_offset_auto_rx(false),
+d_dc_offset_rx(0),
+d_iq_balance_auto_rx(false),
+d_iq_balance_rx(0),
+d_gain_auto_rx(false),
+d_gain_rx(0),
+d_agc_rx(),
+d_bfp_rx(false),
+d_ddc_changed_rx(false),
+d_interpolation_tx(1),
+d_bb_frequency_tx(0),
+d_duc_changed_tx(false),
+d_scan_rx(false),
+d_spectrum_rx(false),
+d_fft_frames_rx(0),
+d_fft_time_rx(-1),
+d_psd_ready_rx(false),
+d_psd_offset_rx(0),
+d_psd_time_rx(-1),
+d_scan_start_rx(0),
+d_scan_steps_rx(0),
+d_scan_bins_rx(0),
+d_scan_settle_rx(0),
+d_scan_step_rx(0),
+d_scan_tuned_rx(false),
+d_scan_ready_rx(0),
+d_scan_skip_rx(0),
+d_spectrum_hop_rx(0),
+d_spectrum_rate_rx(0),
+d_rt_config(rt_config),
+d_tuja(NULL),
+d_replay(replay),
+d_replay_converter(nullptr),
+d_tune_stop(false),
+d_tune_pending(false),
+d_tune_frequency(0),
+d_tuned_frequency(0),
+d_tuned_ns(0),
+d_retune_reported_rx(0)
 {
-    // TODO: maybe make buffer size and periods configurable
-    // we have to experiment with these values
     int err;
     
-    err = tuja_open("/dev/i2c-1", 0x23, &d_tuja);
-    if (err < 0) {
-        throw std::runtime_error("tuja_open" + std::string(strerror(err)));
+    if (d_replay) {
+        // Nothing to tune, the RF is where the recording was made
+        d_center_frequency = d_replay->frequency();
+        if (d_replay->format() != "CS32") {
+            d_replay_converter = SoapySDR::ConverterRegistry::getFunction(d_replay->format(), "CS32");
+            if (d_replay_converter == nullptr) {
+                throw std::runtime_error("SoapySDR::ConverterRegistry function not found: " +
+                                         d_replay->format());
+            }
+        }
+    } else if ((err = tuja_open(i2c_device.c_str(), i2c_address, &d_tuja)) < 0) {
+        throw std::runtime_error("tuja_open: " + std::string(strerror(-err)));
+    }
+    // Wakes the I/O thread out of poll()
+    d_engine_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (d_engine_event < 0) {
+        if (d_tuja != NULL) {
+            tuja_close(d_tuja);
+        }
+        throw std::runtime_error("eventfd: " + std::string(strerror(errno)));
     }
+    // Buffer geometry can be changed per stream by setupStream
+    alsa_config_profile("default", &d_config_rx);
+    alsa_config_profile("default", &d_config_tx);
+    
     // Sample buffer
-    int buff_size = d_channels * d_period_frames;
-    d_buff_rx.resize(buff_size);
-    d_buff_tx.resize(buff_size);
+    d_buff_rx.assign(d_channels * d_config_rx.period_frames, 0);
+    d_buff_tx.assign(d_channels * d_config_tx.period_frames, 0);
+    
+    d_tune_thread = std::thread(&SoapyTujaSDR::tuneWorker, this);
     
     SoapySDR_setLogLevel(SOAPY_SDR_INFO);
 }
 
 SoapyTujaSDR::~SoapyTujaSDR()
 {
-    tuja_close(d_tuja);
+    {
+        std::lock_guard<std::mutex> lock(d_engine_mutex);
+        stopEngine();
+    }
+    {
+        std::lock_guard<std::mutex> lock(d_tune_mutex);
+        d_tune_stop = true;
+        d_tune_cond.notify_one();
+    }
+    d_tune_thread.join();
+    close(d_engine_event);
+    if (d_tuja != NULL) {
+        tuja_close(d_tuja);
+    }
 }
 
 // Identification API
@@ -89,24 +179,34 @@ std::string SoapyTujaSDR::getHardwareKey() const
 // Channels API
 size_t SoapyTujaSDR::getNumChannels(const int dir) const
 {
-    return 1;
-    //return (dir == SOAPY_SDR_RX) ? 1 : 0;
+    // Virtual RX channels are all cut from the one capture
+    return dir == SOAPY_SDR_RX ? d_num_channels_rx : 1;
 }
 
 bool SoapyTujaSDR::getFullDuplex(const int direction, const size_t channel) const
 {
-    // Seems to be ignored by SoapyRemote at least...
+    // Capture and playback are separate PCMs, thread=true services both
+    // from one thread.
     SoapySDR_log(SOAPY_SDR_DEBUG, "getFullDuplex");
-    return false;
+    return true;
 }
 
 // Stream API
 std::vector<std::string> SoapyTujaSDR::getStreamFormats(const int direction, const size_t channel) const
 {
+    // See converters.cpp
     std::vector<std::string> formats;
+    formats.push_back("CS8");
+    formats.push_back("CU8");
+    formats.push_back("CS12");
     formats.push_back("CS16");
     formats.push_back("CS32");
     formats.push_back("CF32");
+    formats.push_back("CF64");
+    if (direction == SOAPY_SDR_RX) {
+        // power spectra, mode=scan or spectrum
+        formats.push_back("F32");
+    }
     return formats;
 }
 
@@ -138,6 +238,229 @@ SoapySDR::ArgInfoList SoapyTujaSDR::getStreamArgsInfo(const int direction, const
      
      streamArgs.push_back(chanArg);
      */
+    
+    SoapySDR::ArgInfo mmapArg;
+    mmapArg.key = "mmap";
+    mmapArg.value = "false";
+    mmapArg.name = "Memory mapped";
+    mmapArg.description = "Access the ALSA DMA ring directly. "
+    "With CS32 this enables the direct buffer access API.";
+    mmapArg.type = SoapySDR::ArgInfo::BOOL;
+    streamArgs.push_back(mmapArg);
+    
+    // The defaults setupStream uses
+    const alsa_config_t config = streamConfig(SoapySDR::Kwargs());
+    
+    SoapySDR::ArgInfo profileArg;
+    profileArg.key = "profile";
+    profileArg.value = "default";
+    profileArg.name = "Latency profile";
+    profileArg.description = "Buffer geometry preset. The arguments below override it.";
+    profileArg.type = SoapySDR::ArgInfo::STRING;
+    profileArg.options = {"default", "low_latency", "throughput"};
+    profileArg.optionNames = {"Default", "Low latency", "Throughput"};
+    streamArgs.push_back(profileArg);
+    
+    SoapySDR::ArgInfo periodsArg;
+    periodsArg.key = "periods";
+    periodsArg.value = std::to_string(config.periods);
+    periodsArg.name = "Periods";
+    periodsArg.description = "Number of periods in the ALSA buffer.";
+    periodsArg.type = SoapySDR::ArgInfo::INT;
+    periodsArg.range = SoapySDR::Range(2, 64);
+    streamArgs.push_back(periodsArg);
+    
+    SoapySDR::ArgInfo periodFramesArg;
+    periodFramesArg.key = "period_frames";
+    periodFramesArg.value = std::to_string(config.period_frames);
+    periodFramesArg.name = "Period size";
+    periodFramesArg.description = "ALSA period size, also the stream MTU.";
+    periodFramesArg.units = "frames";
+    periodFramesArg.type = SoapySDR::ArgInfo::INT;
+    periodFramesArg.range = SoapySDR::Range(32, 65536);
+    streamArgs.push_back(periodFramesArg);
+    
+    SoapySDR::ArgInfo availMinArg;
+    availMinArg.key = "avail_min";
+    availMinArg.value = std::to_string(config.avail_min);
+    availMinArg.name = "Minimum available";
+    availMinArg.description = "Frames that must be available before a wakeup.";
+    availMinArg.units = "frames";
+    availMinArg.type = SoapySDR::ArgInfo::INT;
+    streamArgs.push_back(availMinArg);
+    
+    if (direction == SOAPY_SDR_TX) {
+        SoapySDR::ArgInfo startArg;
+        startArg.key = "start_threshold";
+        startArg.value = std::to_string(config.start_threshold);
+        startArg.name = "Start threshold";
+        startArg.description = "Frames queued before playback starts, "
+        "defaults to full enough that less than avail_min is free.";
+        startArg.units = "frames";
+        startArg.type = SoapySDR::ArgInfo::INT;
+        streamArgs.push_back(startArg);
+        
+        SoapySDR::ArgInfo prefillArg;
+        prefillArg.key = "prefill";
+        prefillArg.value = "0";
+        prefillArg.name = "Silence prefill";
+        prefillArg.description = "Frames of silence queued on activation and after an underrun. "
+        "At or above the start threshold playback starts right away and the first samples "
+        "written play this much later.";
+        prefillArg.units = "frames";
+        prefillArg.type = SoapySDR::ArgInfo::INT;
+        streamArgs.push_back(prefillArg);
+        
+        SoapySDR::ArgInfo underrunArg;
+        underrunArg.key = "underrun";
+        underrunArg.value = "recover";
+        underrunArg.name = "Underrun handling";
+        underrunArg.description = "recover stops playback on underrun and restarts it, "
+        "fill keeps playing silence until samples arrive and counts it in tx_inserted.";
+        underrunArg.type = SoapySDR::ArgInfo::STRING;
+        underrunArg.options = {"recover", "fill"};
+        underrunArg.optionNames = {"Recover", "Fill with silence"};
+        streamArgs.push_back(underrunArg);
+    }
+    
+    if (direction == SOAPY_SDR_TX) {
+        SoapySDR::ArgInfo linkArg;
+        linkArg.key = "link";
+        linkArg.value = "false";
+        linkArg.name = "Link to RX";
+        linkArg.description = "Start and stop playback together with capture, sample for sample. "
+        "Playback then never underruns, it plays silence when starved.";
+        linkArg.type = SoapySDR::ArgInfo::BOOL;
+        streamArgs.push_back(linkArg);
+    }
+    
+    if (direction == SOAPY_SDR_RX) {
+        SoapySDR::ArgInfo modeArg;
+        modeArg.key = "mode";
+        modeArg.value = "iq";
+        modeArg.name = "Stream mode";
+        modeArg.description = "iq streams samples. scan sweeps the RF range given below and "
+        "streams one stitched power spectrum per sweep, spectrum streams averaged power "
+        "spectra of the signal, both in dBFS as F32.";
+        modeArg.type = SoapySDR::ArgInfo::STRING;
+        modeArg.options = {"iq", "scan", "spectrum"};
+        modeArg.optionNames = {"IQ samples", "Band scan", "Power spectrum"};
+        streamArgs.push_back(modeArg);
+        
+        SoapySDR::ArgInfo ditherArg;
+        ditherArg.key = "dither";
+        ditherArg.value = "false";
+        ditherArg.name = "Dither";
+        ditherArg.description = "Add one LSB of triangular dither before rounding to "
+        "CS16, CS12, CS8 or CU8, so weak signals don't turn into quantization spurs.";
+        ditherArg.type = SoapySDR::ArgInfo::BOOL;
+        streamArgs.push_back(ditherArg);
+        
+        SoapySDR::ArgInfo bfpArg;
+        bfpArg.key = "bfp";
+        bfpArg.value = "false";
+        bfpArg.name = "Block floating point";
+        bfpArg.description = "Scale each block of CS16, CS12, CS8 or CU8 up by the largest power "
+        "of two that stays below full scale. The exponent e, 0 to 15, is in the flags, "
+        "flags / SOAPY_SDR_USER_FLAG1 & 15, divide the block by 2^e.";
+        bfpArg.type = SoapySDR::ArgInfo::BOOL;
+        streamArgs.push_back(bfpArg);
+        
+        SoapySDR::ArgInfo scanStartArg;
+        scanStartArg.key = "scan_start";
+        scanStartArg.name = "Scan start";
+        scanStartArg.description = "Frequency of the first bin of a sweep.";
+        scanStartArg.units = "Hz";
+        scanStartArg.type = SoapySDR::ArgInfo::FLOAT;
+        streamArgs.push_back(scanStartArg);
+        
+        SoapySDR::ArgInfo scanStopArg;
+        scanStopArg.key = "scan_stop";
+        scanStopArg.name = "Scan stop";
+        scanStopArg.description = "A sweep covers up to at least this frequency.";
+        scanStopArg.units = "Hz";
+        scanStopArg.type = SoapySDR::ArgInfo::FLOAT;
+        streamArgs.push_back(scanStopArg);
+        
+        SoapySDR::ArgInfo scanStepArg;
+        scanStepArg.key = "scan_step";
+        scanStepArg.value = std::to_string(d_sample_rate / 2);
+        scanStepArg.name = "Scan step";
+        scanStepArg.description = "Retune step, rounded to whole FFT bins. Each step keeps "
+        "this much of the middle of the capture.";
+        scanStepArg.units = "Hz";
+        scanStepArg.type = SoapySDR::ArgInfo::FLOAT;
+        scanStepArg.range = SoapySDR::Range(0, d_sample_rate);
+        streamArgs.push_back(scanStepArg);
+        
+        SoapySDR::ArgInfo scanSettleArg;
+        scanSettleArg.key = "scan_settle";
+        scanSettleArg.value = "256";
+        scanSettleArg.name = "Scan settle";
+        scanSettleArg.description = "Frames dropped after each retune.";
+        scanSettleArg.units = "frames";
+        scanSettleArg.type = SoapySDR::ArgInfo::INT;
+        streamArgs.push_back(scanSettleArg);
+        
+        SoapySDR::ArgInfo fftSizeArg;
+        fftSizeArg.key = "fft_size";
+        fftSizeArg.value = "1024";
+        fftSizeArg.name = "FFT size";
+        fftSizeArg.description = "Frames per FFT in scan and spectrum mode, a power of two.";
+        fftSizeArg.units = "frames";
+        fftSizeArg.type = SoapySDR::ArgInfo::INT;
+        fftSizeArg.range = SoapySDR::Range(16, 65536);
+        streamArgs.push_back(fftSizeArg);
+        
+        SoapySDR::ArgInfo fftWindowArg;
+        fftWindowArg.key = "fft_window";
+        fftWindowArg.value = "blackman_harris";
+        fftWindowArg.name = "FFT window";
+        fftWindowArg.description = "Window applied before each FFT.";
+        fftWindowArg.type = SoapySDR::ArgInfo::STRING;
+        fftWindowArg.options = {"rectangular", "hann", "blackman_harris"};
+        fftWindowArg.optionNames = {"Rectangular", "Hann", "Blackman-Harris"};
+        streamArgs.push_back(fftWindowArg);
+        
+        SoapySDR::ArgInfo fftOverlapArg;
+        fftOverlapArg.key = "fft_overlap";
+        fftOverlapArg.value = "0.5";
+        fftOverlapArg.name = "FFT overlap";
+        fftOverlapArg.description = "Fraction of each FFT shared with the next in spectrum mode.";
+        fftOverlapArg.type = SoapySDR::ArgInfo::FLOAT;
+        fftOverlapArg.range = SoapySDR::Range(0, 0.95);
+        streamArgs.push_back(fftOverlapArg);
+        
+        SoapySDR::ArgInfo frameRateArg;
+        frameRateArg.key = "frame_rate";
+        frameRateArg.value = "10";
+        frameRateArg.name = "Frame rate";
+        frameRateArg.description = "Spectra per second in spectrum mode, each averages the FFTs "
+        "since the last. At most one per FFT.";
+        frameRateArg.units = "Hz";
+        frameRateArg.type = SoapySDR::ArgInfo::FLOAT;
+        streamArgs.push_back(frameRateArg);
+    }
+    
+    SoapySDR::ArgInfo threadArg;
+    threadArg.key = "thread";
+    threadArg.value = "false";
+    threadArg.name = "I/O thread";
+    threadArg.description = "Move samples between ALSA and a ring buffer from a background thread. "
+    "readStream and writeStream then handle any number of elements without syscalls. "
+    "RX and TX share one thread.";
+    threadArg.type = SoapySDR::ArgInfo::BOOL;
+    streamArgs.push_back(threadArg);
+    
+    SoapySDR::ArgInfo ringArg;
+    ringArg.key = "ring_frames";
+    ringArg.value = "65536";
+    ringArg.name = "Ring size";
+    ringArg.description = "I/O thread ring buffer size in frames, rounded up to a power of two.";
+    ringArg.units = "frames";
+    ringArg.type = SoapySDR::ArgInfo::INT;
+    streamArgs.push_back(ringArg);
+    
     return streamArgs;
 }
 
@@ -146,59 +469,281 @@ SoapySDR::Stream *SoapyTujaSDR::setupStream(const int direction, const std::stri
     SoapySDR_log(SOAPY_SDR_DEBUG, "setupStream");
     
     // Check the format
-    if (format == "CF32") {}
-    else if (format == "CS32") {}
-    else if (format == "CS16") {}
-    else throw std::runtime_error("setupStream invalid format " + format);
+    const std::vector<std::string> formats = getStreamFormats(direction, 0);
+    if (std::find(formats.begin(), formats.end(), format) == formats.end()) {
+        throw std::runtime_error("setupStream invalid format " + format);
+    }
     
-    // TODO: Check this
     // Check the channel configuration
-    if (channels.size() > 1 or (channels.size() > 0 and channels.at(0) != 0))
-    {
-        throw std::runtime_error("setupStream invalid channel selection");
+    const std::vector<size_t> selected = channels.empty() ? std::vector<size_t>(1, 0) : channels;
+    const size_t numChannels = getNumChannels(direction);
+    for (size_t i = 0; i < selected.size(); i++) {
+        if (selected[i] >= numChannels or
+            std::find(selected.begin(), selected.begin() + i, selected[i]) != selected.begin() + i) {
+            throw std::runtime_error("setupStream invalid channel selection");
+        }
     }
     
     if (direction == SOAPY_SDR_RX) {
         // RX
-        d_converter_func_rx = SoapySDR::ConverterRegistry::getFunction("CS32", format);
-        // reset buffer so there's zero chance we get garbage
-        std::fill(d_buff_rx.begin(), d_buff_rx.end(), 0);
+        const std::string mode = args.count("mode") ? args.at("mode") : "iq";
+        if (mode != "iq" and mode != "scan" and mode != "spectrum") {
+            throw std::runtime_error("setupStream invalid mode " + mode);
+        }
+        if (d_replay and (mode == "scan" or
+                          (args.count("mmap") and args.at("mmap") == "true") or
+                          (args.count("thread") and args.at("thread") == "true"))) {
+            throw std::runtime_error("setupStream a replay can't scan, mmap or thread");
+        }
+        d_scan_rx = mode == "scan";
+        d_spectrum_rx = mode == "spectrum";
+        const bool fft = d_scan_rx or d_spectrum_rx;
+        if (fft != (format == "F32") or (fft and selected.size() != 1)) {
+            throw std::runtime_error("setupStream F32 goes with mode=scan or spectrum and one channel");
+        }
+        // Rounding to the narrow formats can be dithered and block scaled
+        const bool dither = args.count("dither") and args.at("dither") == "true";
+        d_bfp_rx = args.count("bfp") and args.at("bfp") == "true";
+        if ((dither or d_bfp_rx) and ditheredConverter(format) == nullptr) {
+            throw std::runtime_error("setupStream dither and bfp need CS16, CS12, CS8 or CU8");
+        }
+        // The FFT modes read native samples
+        d_converter_func_rx = dither ? ditheredConverter(format) :
+        SoapySDR::ConverterRegistry::getFunction("CS32", fft ? "CS32" : format);
         if (d_converter_func_rx == nullptr) {
             throw std::runtime_error("SoapySDR::ConverterRegistry function not found: " + format);
         }
-        d_pcm_capture_handle = alsa_pcm_handle(d_alsa_device.c_str(),
-                                               d_sample_rate,
-                                               d_periods,
-                                               d_period_frames,
-                                               SND_PCM_STREAM_CAPTURE);
-        
-        if (d_pcm_capture_handle == nullptr) {
-            throw std::runtime_error("alsa_pcm_handle");
+        d_config_rx = streamConfig(args);
+        d_stats_rx.reset();
+        d_buff_rx.assign(d_channels * d_config_rx.period_frames, 0);
+        // One downconverter and output buffer per channel, fresh so they
+        // start out aligned
+        d_stream_channels_rx = selected;
+        d_ddc_rx.setNumChannels(selected.size());
+        d_ddc_buff_rx.assign(selected.size() * d_channels * d_config_rx.period_frames, 0);
+        d_ddc_outs_rx.assign(selected.size(), nullptr);
+        d_ddc_changed_rx = true;
+        d_native_rx = format == "CS32" or fft;
+        if (fft) {
+            setupFft(args);
         }
+        if (d_scan_rx) {
+            setupScan(args);
+        }
+        if (d_spectrum_rx) {
+            setupSpectrum(args);
+        }
+        d_mmap_rx = args.count("mmap") and args.at("mmap") == "true";
+        d_threaded_rx = args.count("thread") and args.at("thread") == "true";
+        // the rings hold native samples so only CS32 can be handed out as
+        // is, and only for the one channel that is the capture itself
+        d_direct_rx = (d_mmap_rx or d_threaded_rx) and format == "CS32" and selected.size() == 1;
+        if (d_threaded_rx) {
+            size_t ring_frames = 65536;
+            if (args.count("ring_frames")) {
+                ring_frames = std::stoul(args.at("ring_frames"));
+            }
+            // at least a couple of periods or the capture thread just drops
+            ring_frames = std::max<size_t>(ring_frames, 2 * d_config_rx.period_frames);
+            d_ring_rx.reset(new RingBuffer(ring_frames, d_channels * sizeof(int32_t)));
+        }
+        d_config_rx.access = d_mmap_rx ?
+        SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED;
+        // the I/O thread polls
+        d_config_rx.mode = d_threaded_rx ? SND_PCM_NONBLOCK : 0;
+        if (not d_replay) {
+            d_pcm_capture_handle = alsa_pcm_handle(d_alsa_device.c_str(),
+                                                   d_sample_rate,
+                                                   &d_config_rx,
+                                                   SND_PCM_STREAM_CAPTURE);
+            
+            if (d_pcm_capture_handle == nullptr) {
+                throw std::runtime_error("alsa_pcm_handle");
+            }
+        }
+        lockBuffers(SOAPY_SDR_RX);
+        linkStreams();
     }
     
     else if (direction == SOAPY_SDR_TX) {
         // TX
+        if (d_replay) {
+            throw std::runtime_error("setupStream a replay has no TX");
+        }
         d_converter_func_tx = SoapySDR::ConverterRegistry::getFunction(format, "CS32");
-        std::fill(d_buff_tx.begin(), d_buff_tx.end(), 0);
         if (d_converter_func_tx == nullptr) {
             throw std::runtime_error("SoapySDR::ConverterRegistry function not found: " + format);
         }
+        d_config_tx = streamConfig(args);
+        d_stats_tx.reset();
+        d_buff_tx.assign(d_channels * d_config_tx.period_frames, 0);
+        d_duc_buff_tx.assign(d_channels * d_config_tx.period_frames, 0);
+        d_duc_tx.reset();
+        d_duc_changed_tx = true;
+        d_native_tx = format == "CS32";
+        d_mmap_tx = args.count("mmap") and args.at("mmap") == "true";
+        d_threaded_tx = args.count("thread") and args.at("thread") == "true";
+        d_direct_tx = (d_mmap_tx or d_threaded_tx) and format == "CS32";
+        if (d_threaded_tx) {
+            size_t ring_frames = 65536;
+            if (args.count("ring_frames")) {
+                ring_frames = std::stoul(args.at("ring_frames"));
+            }
+            ring_frames = std::max<size_t>(ring_frames, 2 * d_config_tx.period_frames);
+            d_ring_tx.reset(new RingBuffer(ring_frames, d_channels * sizeof(int32_t)));
+        }
+        d_config_tx.access = d_mmap_tx ?
+        SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED;
+        d_config_tx.mode = d_threaded_tx ? SND_PCM_NONBLOCK : 0;
+        d_link_tx = args.count("link") and args.at("link") == "true";
+        d_fill_tx = args.count("underrun") and args.at("underrun") == "fill";
+        if (args.count("underrun") and not d_fill_tx and args.at("underrun") != "recover") {
+            throw std::runtime_error("setupStream invalid underrun " + args.at("underrun"));
+        }
+        d_prefill_tx = args.count("prefill") ? std::stoul(args.at("prefill")) : 0;
+        if (d_prefill_tx > d_config_tx.periods * d_config_tx.period_frames) {
+            throw std::runtime_error("setupStream invalid prefill");
+        }
+        d_config_tx.free_run = d_link_tx or d_fill_tx;
         d_pcm_playback_handle = alsa_pcm_handle(d_alsa_device.c_str(),
                                                 d_sample_rate,
-                                                d_periods,
-                                                d_period_frames,
+                                                &d_config_tx,
                                                 SND_PCM_STREAM_PLAYBACK);
         
         if (d_pcm_playback_handle == nullptr) {
             throw std::runtime_error("alsa_pcm_handle");
         }
+        lockBuffers(SOAPY_SDR_TX);
+        linkStreams();
     }
     
     // Stream can apparently be anything
     return (SoapySDR::Stream *)(new int(direction));
 }
 
+// FFT size and window, for both FFT modes
+void SoapyTujaSDR::setupFft(const SoapySDR::Kwargs &args)
+{
+    const size_t size = args.count("fft_size") ? std::stoul(args.at("fft_size")) : 1024;
+    const std::string window = args.count("fft_window") ? args.at("fft_window") : "blackman_harris";
+    
+    if (size < 16 or size > 65536 or (size & (size - 1)) != 0) {
+        throw std::runtime_error("setupStream invalid fft_size");
+    }
+    if (not Spectrum::hasWindow(window)) {
+        throw std::runtime_error("setupStream invalid fft_window " + window);
+    }
+    d_psd_rx.setSize(size, window);
+    d_fft_buff_rx.assign(d_channels * size, 0);
+    d_fft_frames_rx = 0;
+    d_psd_ready_rx = false;
+    d_psd_offset_rx = 0;
+    d_psd_time_rx = -1;
+}
+
+// Sweep geometry from the stream args. The step is whole bins so the
+// stitched spectrum has one bin spacing throughout.
+void SoapyTujaSDR::setupScan(const SoapySDR::Kwargs &args)
+{
+    if (args.count("scan_start") == 0 or args.count("scan_stop") == 0) {
+        throw std::runtime_error("setupStream mode=scan needs scan_start and scan_stop");
+    }
+    const double start = std::stod(args.at("scan_start"));
+    const double stop = std::stod(args.at("scan_stop"));
+    const double step = args.count("scan_step") ? std::stod(args.at("scan_step")) : d_sample_rate / 2;
+    const size_t size = d_psd_rx.size();
+    
+    const double bin = d_sample_rate / size;
+    if (stop <= start or step < bin or step > d_sample_rate) {
+        throw std::runtime_error("setupStream invalid scan range");
+    }
+    d_scan_start_rx = start;
+    d_scan_bins_rx = (size_t) std::lround(step / bin);
+    d_scan_steps_rx = (size_t) std::ceil((stop - start) / (d_scan_bins_rx * bin));
+    
+    const SoapySDR::Range range = getFrequencyRange(SOAPY_SDR_RX, 0, "RF").front();
+    if (scanFrequency(0) < range.minimum() or scanFrequency(d_scan_steps_rx - 1) > range.maximum()) {
+        throw std::runtime_error("setupStream scan outside the RF range");
+    }
+    d_scan_settle_rx = args.count("scan_settle") ? std::stoul(args.at("scan_settle")) : 256;
+    d_scan_power_rx.assign(size, 0);
+    d_psd_out_rx.assign(d_scan_steps_rx * d_scan_bins_rx, 0);
+    d_scan_step_rx = 0;
+    d_scan_tuned_rx = false;
+}
+
+// Averaging from the stream args. The number of FFTs per frame follows
+// the sample rate, see readSpectrum.
+void SoapyTujaSDR::setupSpectrum(const SoapySDR::Kwargs &args)
+{
+    const double overlap = args.count("fft_overlap") ? std::stod(args.at("fft_overlap")) : 0.5;
+    const double rate = args.count("frame_rate") ? std::stod(args.at("frame_rate")) : 10;
+    
+    if (overlap < 0 or overlap > 0.95) {
+        throw std::runtime_error("setupStream invalid fft_overlap");
+    }
+    if (rate <= 0) {
+        throw std::runtime_error("setupStream invalid frame_rate");
+    }
+    d_spectrum_hop_rx = std::max<size_t>(1, std::lround(d_psd_rx.size() * (1 - overlap)));
+    d_spectrum_rate_rx = rate;
+    d_psd_out_rx.assign(d_psd_rx.size(), 0);
+}
+
+// LO for a scan step, its bins sit either side of it
+double SoapyTujaSDR::scanFrequency(const size_t step) const
+{
+    const double bin = d_sample_rate / d_psd_rx.size();
+    return d_scan_start_rx + (step * d_scan_bins_rx + d_scan_bins_rx / 2) * bin;
+}
+
+// Buffer geometry from a profile and individual overrides
+alsa_config_t SoapyTujaSDR::streamConfig(const SoapySDR::Kwargs &args) const
+{
+    alsa_config_t config;
+    const std::string profile = args.count("profile") ? args.at("profile") : "default";
+    
+    if (alsa_config_profile(profile.c_str(), &config) < 0) {
+        throw std::runtime_error("setupStream invalid profile " + profile);
+    }
+    
+    if (args.count("periods")) {
+        config.periods = std::stoul(args.at("periods"));
+    }
+    if (args.count("period_frames")) {
+        config.period_frames = std::stoul(args.at("period_frames"));
+        // by default never wait for more than a period
+        config.avail_min = std::min<snd_pcm_uframes_t>(config.avail_min, config.period_frames);
+    }
+    if (args.count("avail_min")) {
+        config.avail_min = std::stoul(args.at("avail_min"));
+    }
+    // Full buffer unless asked otherwise. Full enough that less than
+    // avail_min is free, poll() won't wake us to top up the last frames and
+    // blocks that don't divide the buffer, like interpolated ones, would
+    // never start playback.
+    config.start_threshold = config.periods * config.period_frames - config.avail_min + 1;
+    if (args.count("start_threshold")) {
+        config.start_threshold = std::stoul(args.at("start_threshold"));
+    }
+    
+    const snd_pcm_uframes_t buffer_frames = config.periods * config.period_frames;
+    if (config.periods < 2 or config.period_frames == 0) {
+        throw std::runtime_error("setupStream invalid buffer geometry");
+    }
+    if (config.avail_min == 0 or config.avail_min > buffer_frames) {
+        throw std::runtime_error("setupStream invalid avail_min");
+    }
+    if (config.start_threshold == 0 or config.start_threshold > buffer_frames) {
+        throw std::runtime_error("setupStream invalid start_threshold");
+    }
+    
+    SoapySDR_logf(SOAPY_SDR_DEBUG, "setupStream %s: periods=%u period_frames=%lu avail_min=%lu start_threshold=%lu",
+                  profile.c_str(), config.periods, config.period_frames,
+                  config.avail_min, config.start_threshold);
+    return config;
+}
+
 void SoapyTujaSDR::closeStream(SoapySDR::Stream *stream)
 {
     const int direction = *reinterpret_cast<int *>(stream);
@@ -206,22 +751,70 @@ void SoapyTujaSDR::closeStream(SoapySDR::Stream *stream)
     SoapySDR_log(SOAPY_SDR_DEBUG, "closeStream");
     
     if (direction == SOAPY_SDR_RX) {
-        snd_pcm_close(d_pcm_capture_handle); // close handle
+        if (d_threaded_rx) {
+            setEngine(SOAPY_SDR_RX, false);
+        }
+        unlinkStreams();
+        if (d_pcm_capture_handle != nullptr) {
+            snd_pcm_close(d_pcm_capture_handle); // close handle
+        }
+        unlockBuffers(SOAPY_SDR_RX);
+        if (d_scan_rx) {
+            // Back to where setFrequency left the LO
+            std::lock_guard<std::mutex> lock(d_tune_mutex);
+            d_tune_frequency = d_center_frequency;
+            d_tune_pending = true;
+            d_tune_cond.notify_one();
+            d_scan_rx = false;
+        }
+        d_spectrum_rx = false;
         d_converter_func_rx = nullptr;
         d_pcm_capture_handle = nullptr;
+        d_mmap_rx = false;
+        d_direct_rx = false;
+        d_threaded_rx = false;
+        d_ring_rx.reset();
+        d_sample_index_rx = 0;
+        d_anchored_rx = false;
+        d_need_anchor_rx = true;
+        d_active_rx = false;
     }
     else if (direction == SOAPY_SDR_TX) {
+        if (d_threaded_tx) {
+            setEngine(SOAPY_SDR_TX, false);
+        }
+        unlinkStreams();
         snd_pcm_close(d_pcm_playback_handle); // close handle
+        unlockBuffers(SOAPY_SDR_TX);
         d_converter_func_tx = nullptr;
         d_pcm_playback_handle = nullptr;
+        d_mmap_tx = false;
+        d_direct_tx = false;
+        d_threaded_tx = false;
+        d_ring_tx.reset();
+        d_link_tx = false;
+        d_fill_tx = false;
+        d_prefill_tx = 0;
+        d_active_tx = false;
     }
 }
 
 size_t SoapyTujaSDR::getStreamMTU(SoapySDR::Stream *stream) const
 {
+    const int direction = *reinterpret_cast<int *>(stream);
+    
     SoapySDR_log(SOAPY_SDR_DEBUG, "get mtu");
-    // Stream MTU in number of elements
-    return d_period_frames;
+    // Stream MTU in number of elements, a period after decimation or a
+    // whole spectrum
+    if (direction == SOAPY_SDR_RX and (d_scan_rx or d_spectrum_rx)) {
+        return d_psd_out_rx.size();
+    }
+    if (direction == SOAPY_SDR_RX) {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        return std::max<size_t>(1, d_config_rx.period_frames / d_decimation_rx);
+    }
+    std::lock_guard<std::mutex> lock(d_duc_mutex);
+    return std::max<size_t>(1, d_config_tx.period_frames / d_interpolation_tx);
 }
 
 int SoapyTujaSDR::activateStream(SoapySDR::Stream *stream,
@@ -236,6 +829,12 @@ int SoapyTujaSDR::activateStream(SoapySDR::Stream *stream,
     
     switch (direction) {
         case SOAPY_SDR_RX:
+            if (d_replay) {
+                // carries on where it was deactivated
+                d_replay->start();
+                d_active_rx = true;
+                break;
+            }
             snd_state = snd_pcm_state(d_pcm_capture_handle);
             if(snd_state != SND_PCM_STATE_RUNNING) {
                 err = snd_pcm_prepare(d_pcm_capture_handle);
@@ -244,17 +843,29 @@ int SoapyTujaSDR::activateStream(SoapySDR::Stream *stream,
                 SoapySDR_logf(SOAPY_SDR_ERROR, "activateStream (SOAPY_SDR_RX): %s snd_pcm_prepare %s",
                               alsa_state_str(snd_state), snd_strerror(err));
                 return err;
-            } break;
+            }
+            if (d_threaded_rx) {
+                setEngine(SOAPY_SDR_RX, true);
+            }
+            d_active_rx = true;
+            break;
         case SOAPY_SDR_TX:
             snd_state = snd_pcm_state(d_pcm_playback_handle);
             if(snd_state != SND_PCM_STATE_RUNNING) {
-                err = snd_pcm_prepare(d_pcm_playback_handle);
+                if ((err = snd_pcm_prepare(d_pcm_playback_handle)) == 0) {
+                    err = prefillPlayback();
+                }
             }
             if (err < 0) {
                 SoapySDR_logf(SOAPY_SDR_ERROR, "activateStream (SOAPY_SDR_TX): %s snd_pcm_prepare %s",
                               alsa_state_str(snd_state), snd_strerror(err));
                 return err;
-            } break;
+            }
+            if (d_threaded_tx) {
+                setEngine(SOAPY_SDR_TX, true);
+            }
+            d_active_tx = true;
+            break;
     }
     
     return err;
@@ -268,8 +879,16 @@ int SoapyTujaSDR::deactivateStream(SoapySDR::Stream *stream, const int flags, co
     
     switch (direction) {
         case SOAPY_SDR_RX:
+            if (d_threaded_rx) {
+                setEngine(SOAPY_SDR_RX, false);
+            }
+            d_active_rx = false;
+            if (d_replay) {
+                break;
+            }
             snd_state = snd_pcm_state(d_pcm_capture_handle);
-            if(snd_state == SND_PCM_STATE_RUNNING) {
+            // linked, dropping capture would stop playback too
+            if(snd_state == SND_PCM_STATE_RUNNING and not (d_linked and d_active_tx)) {
                 err = snd_pcm_drop(d_pcm_capture_handle); // stop and drop
             }
             if(err < 0) {
@@ -278,12 +897,17 @@ int SoapyTujaSDR::deactivateStream(SoapySDR::Stream *stream, const int flags, co
                 return err;
             } break;
         case SOAPY_SDR_TX:
+            if (d_threaded_tx) {
+                setEngine(SOAPY_SDR_TX, false);
+            }
+            d_active_tx = false;
             snd_state = snd_pcm_state(d_pcm_playback_handle);
-            if(snd_state == SND_PCM_STATE_RUNNING) {
+            // linked playback keeps running, silent, while capture is active
+            if(snd_state == SND_PCM_STATE_RUNNING and not (d_linked and d_active_rx)) {
                 err = snd_pcm_drop(d_pcm_playback_handle); // stop and drop
             }
             if (err < 0) {
-                SoapySDR_logf(SOAPY_SDR_ERROR, "deactivateStream (SOAPY_SDR_RX): %s snd_pcm_drop %s",
+                SoapySDR_logf(SOAPY_SDR_ERROR, "deactivateStream (SOAPY_SDR_TX): %s snd_pcm_drop %s",
                               alsa_state_str(snd_state), snd_strerror(err));
                 return err;
             } break;
@@ -298,9 +922,193 @@ int SoapyTujaSDR::readStream(SoapySDR::Stream *stream,
                              int &flags,
                              long long &timeNs,
                              const long timeoutUs)
+{
+    if (d_scan_rx) {
+        return readScan(buffs, numElems, flags, timeNs, timeoutUs);
+    }
+    if (d_spectrum_rx) {
+        return readSpectrum(buffs, numElems, flags, timeNs, timeoutUs);
+    }
+    return readCapture(buffs, numElems, flags, timeNs, timeoutUs);
+}
+
+// Works through the sweep a step at a time until it's complete or the
+// timeout runs out, the next call then carries on.
+int SoapyTujaSDR::readScan(void * const *buffs,
+                           const size_t numElems,
+                           int &flags,
+                           long long &timeNs,
+                           const long timeoutUs)
+{
+    const long long deadline = getHardwareTime() + timeoutUs * 1000LL;
+    const size_t size = d_psd_rx.size();
+    
+    while (not d_psd_ready_rx) {
+        if (not d_scan_tuned_rx) {
+            int err;
+            {
+                std::lock_guard<std::mutex> lock(d_tuja_mutex);
+                err = tuja_set_frequency(d_tuja, (uint32_t) scanFrequency(d_scan_step_rx));
+            }
+            if (err < 0) {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "readScan: tuja_set_frequency: %s", strerror(-err));
+                return SOAPY_SDR_STREAM_ERROR;
+            }
+            d_scan_ready_rx = getHardwareTime() + SoapySDR::ticksToTimeNs(d_scan_settle_rx, d_sample_rate);
+            d_scan_skip_rx = d_scan_settle_rx;
+            d_fft_frames_rx = 0;
+            d_scan_tuned_rx = true;
+        }
+        
+        int32_t *frame = d_fft_buff_rx.data() + (size_t) d_channels * d_fft_frames_rx;
+        void *buff = frame;
+        int blockFlags = 0;
+        long long blockTime = 0;
+        const int n = readCapture(&buff, size - d_fft_frames_rx, blockFlags, blockTime, timeoutUs);
+        if (n == SOAPY_SDR_OVERFLOW) {
+            // No FFT across the gap, this step starts over after it and
+            // so does the sweep time on the first step
+            d_fft_frames_rx = 0;
+            if (d_scan_step_rx == 0) {
+                d_psd_time_rx = -1;
+            }
+            continue;
+        }
+        if (n < 0) {
+            return n;
+        }
+        
+        // Drop what was captured before the settle window ran out,
+        // counted in frames when there are no timestamps
+        size_t skip;
+        if (blockFlags & SOAPY_SDR_HAS_TIME) {
+            skip = blockTime >= d_scan_ready_rx ? 0 :
+            std::min<size_t>(n, std::ceil((d_scan_ready_rx - blockTime) * d_sample_rate / 1e9));
+        } else {
+            skip = std::min<size_t>(n, d_scan_skip_rx);
+            d_scan_skip_rx -= skip;
+        }
+        if (d_scan_step_rx == 0 and d_fft_frames_rx == 0 and (size_t) n > skip) {
+            d_psd_time_rx = blockFlags & SOAPY_SDR_HAS_TIME ?
+            blockTime + SoapySDR::ticksToTimeNs(skip, d_sample_rate) : -1;
+        }
+        std::memmove(frame, frame + (size_t) d_channels * skip, (n - skip) * d_channels * sizeof(int32_t));
+        d_fft_frames_rx += n - skip;
+        
+        if (d_fft_frames_rx == size) {
+            d_psd_rx.add(d_fft_buff_rx.data());
+            d_psd_rx.power(d_scan_power_rx.data());
+            // The middle of the capture, away from the band edges
+            std::memcpy(d_psd_out_rx.data() + d_scan_step_rx * d_scan_bins_rx,
+                        d_scan_power_rx.data() + size / 2 - d_scan_bins_rx / 2,
+                        d_scan_bins_rx * sizeof(float));
+            d_scan_tuned_rx = false;
+            if (++d_scan_step_rx == d_scan_steps_rx) {
+                d_scan_step_rx = 0;
+                d_psd_ready_rx = true;
+            }
+        }
+        if (not d_psd_ready_rx and getHardwareTime() > deadline) {
+            return SOAPY_SDR_TIMEOUT;
+        }
+    }
+    return readPsd(buffs, numElems, flags, timeNs);
+}
+
+// Averages FFTs a hop apart until there's a frame's worth for the frame
+// rate. Like a sweep this can take more than one call.
+int SoapyTujaSDR::readSpectrum(void * const *buffs,
+                               const size_t numElems,
+                               int &flags,
+                               long long &timeNs,
+                               const long timeoutUs)
+{
+    const long long deadline = getHardwareTime() + timeoutUs * 1000LL;
+    const size_t size = d_psd_rx.size();
+    const size_t hop = d_spectrum_hop_rx;
+    
+    while (not d_psd_ready_rx) {
+        int32_t *buff = d_fft_buff_rx.data();
+        void *frame = buff + (size_t) d_channels * d_fft_frames_rx;
+        int blockFlags = 0;
+        long long blockTime = 0;
+        const int n = readCapture(&frame, size - d_fft_frames_rx, blockFlags, blockTime, timeoutUs);
+        if (n == SOAPY_SDR_OVERFLOW) {
+            // No FFT across the gap, the average carries on
+            d_fft_frames_rx = 0;
+            return n;
+        }
+        if (n < 0) {
+            return n;
+        }
+        if (d_fft_frames_rx == 0) {
+            d_fft_time_rx = blockFlags & SOAPY_SDR_HAS_TIME ? blockTime : -1;
+        }
+        d_fft_frames_rx += n;
+        
+        if (d_fft_frames_rx == size) {
+            if (d_psd_rx.count() == 0) {
+                d_psd_time_rx = d_fft_time_rx;
+            }
+            d_psd_rx.add(buff);
+            
+            // Keep the overlap for the next FFT
+            const double rate = d_sample_rate / d_ddc_rx.decimation();
+            std::memmove(buff, buff + (size_t) d_channels * hop, (size - hop) * d_channels * sizeof(int32_t));
+            d_fft_frames_rx -= hop;
+            if (d_fft_time_rx >= 0) {
+                d_fft_time_rx += SoapySDR::ticksToTimeNs(hop, rate);
+            }
+            
+            const size_t averages = std::max<long>(1, std::lround(rate / hop / d_spectrum_rate_rx));
+            if (d_psd_rx.count() >= averages) {
+                d_psd_rx.power(d_psd_out_rx.data());
+                d_psd_ready_rx = true;
+            }
+        }
+        if (not d_psd_ready_rx and getHardwareTime() > deadline) {
+            return SOAPY_SDR_TIMEOUT;
+        }
+    }
+    return readPsd(buffs, numElems, flags, timeNs);
+}
+
+// Hands out the finished spectrum, in fragments if numElems is short.
+// The last one has SOAPY_SDR_END_BURST.
+int SoapyTujaSDR::readPsd(void * const *buffs, const size_t numElems, int &flags, long long &timeNs)
+{
+    const size_t n = std::min(numElems, d_psd_out_rx.size() - d_psd_offset_rx);
+    std::memcpy(buffs[0], d_psd_out_rx.data() + d_psd_offset_rx, n * sizeof(float));
+    d_psd_offset_rx += n;
+    if (d_psd_time_rx >= 0) {
+        timeNs = d_psd_time_rx;
+        flags |= SOAPY_SDR_HAS_TIME;
+    }
+    if (d_psd_offset_rx < d_psd_out_rx.size()) {
+        flags |= SOAPY_SDR_MORE_FRAGMENTS;
+    } else {
+        flags |= SOAPY_SDR_END_BURST;
+        d_psd_ready_rx = false;
+        d_psd_offset_rx = 0;
+    }
+    return (int) n;
+}
+
+// Samples, through the DDC when in use
+int SoapyTujaSDR::readCapture(void * const *buffs,
+                              const size_t numElems,
+                              int &flags,
+                              long long &timeNs,
+                              const long timeoutUs)
 {
     snd_pcm_sframes_t n_err = 0;
     int err = 0;
+    void *rx_buff;
+    uint64_t start;
+    
+    if (d_replay) {
+        return readReplay(buffs, numElems, flags, timeNs, timeoutUs);
+    }
     
     // This function has to be well defined at all times
     if (d_pcm_capture_handle == nullptr) {
@@ -308,6 +1116,35 @@ int SoapyTujaSDR::readStream(SoapySDR::Stream *stream,
         return SOAPY_SDR_STREAM_ERROR;
     }
     
+    if (d_threaded_rx) {
+        // The I/O thread does all the ALSA work, just drain the ring.
+        // It's mirrored so the whole block is contiguous. The DDC needs
+        // enough for at least one output.
+        applyDdc();
+        if ((err = waitCapture(timeoutUs, d_ddc_rx.phase() + 1)) <= 0) {
+            return err;
+        }
+        size_t frames = std::min<size_t>(numElems * d_ddc_rx.decimation(), err);
+        if (d_ddc_rx.active()) {
+            // bounded by the DDC output buffer
+            frames = std::min<size_t>(frames, d_config_rx.period_frames * d_ddc_rx.decimation());
+        }
+        frames = timeCapture(d_ring_rx->readIndex(), frames, flags, timeNs);
+        retunedCapture(timeNs, frames, flags);
+        long long offset;
+        const uint64_t start = StreamStats::nowNs();
+        const size_t n = convertCapture(d_ring_rx->readPtr(), frames, buffs, offset, flags);
+        d_stats_rx.convert.add(StreamStats::nowNs() - start);
+        d_ring_rx->commitRead(frames);
+        d_stats_rx.samples.fetch_add(n, std::memory_order_relaxed);
+        if (flags & SOAPY_SDR_HAS_TIME) {
+            timeNs += SoapySDR::ticksToTimeNs(offset, d_sample_rate);
+        }
+        return (int) n;
+    }
+    
+    applyDdc();
+    realtimeThread(d_rt_thread_rx);
     snd_pcm_state_t snd_state = snd_pcm_state(d_pcm_capture_handle);
     switch (snd_state) {
         case SND_PCM_STATE_OPEN:
@@ -327,29 +1164,79 @@ int SoapyTujaSDR::readStream(SoapySDR::Stream *stream,
                 // could not start
                 SoapySDR_logf(SOAPY_SDR_ERROR, "snd_pcm_start %s", snd_strerror(err));
                 return SOAPY_SDR_STREAM_ERROR;
-            } // fallthrough
+            }
+            d_need_anchor_rx = true; // fallthrough
         case SND_PCM_STATE_RUNNING:
-            if(snd_pcm_wait(d_pcm_capture_handle, int(timeoutUs / 1000.f)) == 0) {
+            start = StreamStats::nowNs();
+            err = snd_pcm_wait(d_pcm_capture_handle, int(timeoutUs / 1000.f));
+            d_stats_rx.wait.add(StreamStats::nowNs() - start);
+            if(err == 0) {
                 SoapySDR_logf(SOAPY_SDR_INFO, "readStream timeout");
                 return SOAPY_SDR_TIMEOUT;
             }
+            if ((n_err = snd_pcm_avail_update(d_pcm_capture_handle)) >= 0) {
+                d_stats_rx.fill.store(n_err, std::memory_order_relaxed);
+            }
+            if (d_need_anchor_rx) {
+                d_need_anchor_rx = not anchorCapture(d_sample_index_rx, d_anchor_rx, d_anchored_rx);
+                d_anchored_rx = d_anchored_rx or not d_need_anchor_rx;
+            }
             // not timed out, try to read
-            n_err = snd_pcm_readi(d_pcm_capture_handle,
-                                  d_buff_rx.data(),
-                                  std::min<size_t>(numElems, d_period_frames));
+            // Native format goes straight into the client buffer, unless
+            // the DDC needs it at the hardware rate first or it feeds
+            // several channels
+            rx_buff = d_native_rx and not d_ddc_rx.active() and d_stream_channels_rx.size() == 1 ?
+            buffs[0] : d_buff_rx.data();
+            start = StreamStats::nowNs();
+            if (d_mmap_rx) {
+                n_err = snd_pcm_mmap_readi(d_pcm_capture_handle,
+                                           rx_buff,
+                                           std::min<size_t>(numElems * d_ddc_rx.decimation(),
+                                                            d_config_rx.period_frames));
+            } else {
+                n_err = snd_pcm_readi(d_pcm_capture_handle,
+                                      rx_buff,
+                                      std::min<size_t>(numElems * d_ddc_rx.decimation(),
+                                                       d_config_rx.period_frames));
+            }
+            d_stats_rx.transfer.add(StreamStats::nowNs() - start);
             // Ok?
             if(n_err >= 0) {
-                // read ok, convert and return.
-                d_converter_func_rx(d_buff_rx.data(), buffs[0], n_err, 1.0);
-                return (int) n_err;
+                // read ok, convert and return. Recorded first, the
+                // conversion may be in place.
+                d_recorder_rx.push((const int32_t *) rx_buff, n_err);
+                long long offset;
+                start = StreamStats::nowNs();
+                const size_t n = convertCapture(rx_buff, n_err, buffs, offset, flags);
+                d_stats_rx.convert.add(StreamStats::nowNs() - start);
+                d_stats_rx.samples.fetch_add(n, std::memory_order_relaxed);
+                if (d_anchored_rx) {
+                    timeNs = d_anchor_rx.timeNs +
+                    SoapySDR::ticksToTimeNs(d_sample_index_rx - d_anchor_rx.index, d_sample_rate);
+                    flags |= SOAPY_SDR_HAS_TIME;
+                }
+                retunedCapture(timeNs, n_err, flags);
+                if (flags & SOAPY_SDR_HAS_TIME) {
+                    timeNs += SoapySDR::ticksToTimeNs(offset, d_sample_rate);
+                }
+                d_sample_index_rx += n_err;
+                return (int) n;
             } // error, fallthrough
         case SND_PCM_STATE_XRUN:
+            if (snd_state == SND_PCM_STATE_XRUN) {
+                n_err = -EPIPE; // entered in XRUN state
+            }
             // try to recover
             if(snd_pcm_recover(d_pcm_capture_handle, (int) n_err, 0) == 0) {
                 SoapySDR_logf(SOAPY_SDR_INFO, "readStream recoverd from overflow");
+                d_recorder_rx.overrun();
+                d_stats_rx.xruns.fetch_add(1, std::memory_order_relaxed);
+                // Samples were lost, the counter no longer tracks time
+                d_need_anchor_rx = true;
                 // Recovered, let Soapy call us again
                 return SOAPY_SDR_OVERFLOW;
             } else {
+                d_stats_rx.recover_failures.fetch_add(1, std::memory_order_relaxed);
                 if ((int)n_err == -EBADFD) {
                     // -EBADFD = file descriptor in bad state meaning the device was closed,
                     // this is expected.
@@ -368,11 +1255,48 @@ int SoapyTujaSDR::readStream(SoapySDR::Stream *stream,
         case SND_PCM_STATE_PAUSED:
         case SND_PCM_STATE_SUSPENDED:
         case SND_PCM_STATE_DISCONNECTED:
-            SoapySDR_logf(SOAPY_SDR_ERROR, "bad ALSA state: %s", snd_state);
+            SoapySDR_logf(SOAPY_SDR_ERROR, "bad ALSA state: %s", alsa_state_str(snd_state));
             return SOAPY_SDR_STREAM_ERROR;
     }
 }
 
+// Blocks of the recording take the same way through the DDC, gain and
+// converters as a capture does, straight from the mapping when CS32
+int SoapyTujaSDR::readReplay(void * const *buffs,
+                             const size_t numElems,
+                             int &flags,
+                             long long &timeNs,
+                             const long timeoutUs)
+{
+    const void *data;
+    
+    applyDdc();
+    timeNs = d_replay->timeNs();
+    const size_t frames = d_replay->next(std::min<size_t>(numElems * d_ddc_rx.decimation(),
+                                                          d_config_rx.period_frames),
+                                         timeoutUs, data);
+    if (frames == 0) {
+        return SOAPY_SDR_TIMEOUT;
+    }
+    flags |= SOAPY_SDR_HAS_TIME;
+    const int32_t *capture = (const int32_t *) data;
+    if (d_replay_converter != nullptr) {
+        d_replay_converter(data, d_buff_rx.data(), frames, 1.0);
+        capture = d_buff_rx.data();
+    }
+    d_recorder_rx.push(capture, frames);
+    long long offset;
+    const uint64_t start = StreamStats::nowNs();
+    const size_t n = convertCapture(capture, frames, buffs, offset, flags);
+    d_stats_rx.convert.add(StreamStats::nowNs() - start);
+    d_stats_rx.samples.fetch_add(n, std::memory_order_relaxed);
+    timeNs += SoapySDR::ticksToTimeNs(offset, d_sample_rate);
+    if (d_replay->atEnd()) {
+        flags |= SOAPY_SDR_END_BURST;
+    }
+    return (int) n;
+}
+
 int SoapyTujaSDR::writeStream (SoapySDR::Stream *stream,
                                const void *const *buffs,
                                const size_t numElems,
@@ -381,13 +1305,40 @@ int SoapyTujaSDR::writeStream (SoapySDR::Stream *stream,
                                const long timeoutUs)
 {
     snd_pcm_sframes_t n_err;
+    snd_pcm_sframes_t avail = -1;
     size_t n;
+    size_t frames;
     int err;
+    const void *tx_buff;
+    uint64_t start;
     
     if (d_pcm_playback_handle == nullptr) {
         return SOAPY_SDR_STREAM_ERROR;
     }
     
+    applyDuc();
+    const size_t interpolation = d_duc_tx.interpolation();
+    
+    if (d_threaded_tx) {
+        // The I/O thread does all the ALSA work, just fill the ring. It's
+        // mirrored so the whole interpolated block is contiguous.
+        if ((err = waitPlayback(timeoutUs, interpolation)) <= 0) {
+            return err;
+        }
+        n = std::min<size_t>(numElems, err / interpolation);
+        if (d_duc_tx.active()) {
+            // bounded by the DUC input buffer
+            n = std::min<size_t>(n, d_config_tx.period_frames);
+        }
+        start = StreamStats::nowNs();
+        const size_t frames = convertPlayback(buffs[0], n, (int32_t *) d_ring_tx->writePtr());
+        d_stats_tx.convert.add(StreamStats::nowNs() - start);
+        commitPlayback(frames);
+        d_stats_tx.samples.fetch_add(n, std::memory_order_relaxed);
+        return (int) n;
+    }
+    
+    realtimeThread(d_rt_thread_tx);
     snd_pcm_state_t snd_state = snd_pcm_state(d_pcm_playback_handle);
     switch (snd_state) {
         case SND_PCM_STATE_OPEN:
@@ -402,29 +1353,71 @@ int SoapyTujaSDR::writeStream (SoapySDR::Stream *stream,
             break;
         case SND_PCM_STATE_RUNNING:
             // if running wait
-            if(snd_pcm_wait(d_pcm_playback_handle, int(timeoutUs / 1000)) == 0) {
+            start = StreamStats::nowNs();
+            err = snd_pcm_wait(d_pcm_playback_handle, int(timeoutUs / 1000));
+            d_stats_tx.wait.add(StreamStats::nowNs() - start);
+            if(err == 0) {
                 return SOAPY_SDR_TIMEOUT;
+            }
+            if ((avail = catchUpPlayback(snd_pcm_avail_update(d_pcm_playback_handle))) >= 0) {
+                d_stats_tx.fill.store(d_config_tx.periods * d_config_tx.period_frames - avail,
+                                      std::memory_order_relaxed);
             } // fallthrough
         case SND_PCM_STATE_PREPARED:
 
             // not started, it will autostart when buffer is full
-            n = std::min<size_t>(numElems, d_period_frames);
-            d_converter_func_tx(buffs[0], d_buff_tx.data(), n, 1.0);
-            n_err = snd_pcm_writei(d_pcm_playback_handle,
-                                   d_buff_tx.data(),
-                                   n);
+            if (snd_state == SND_PCM_STATE_PREPARED) {
+                avail = snd_pcm_avail_update(d_pcm_playback_handle);
+            }
+            n = std::min<size_t>(numElems, std::max<size_t>(1, d_config_tx.period_frames / interpolation));
+            if (d_duc_tx.active() and avail >= 0) {
+                // Interpolated blocks must go in whole, there's no keeping
+                // the tail of one for the next call
+                n = std::min<size_t>(n, avail / interpolation);
+                if (n == 0) {
+                    return 0;
+                }
+            }
+            // Native format is written straight from the client buffer
+            tx_buff = d_native_tx and not d_duc_tx.active() ? buffs[0] : d_buff_tx.data();
+            frames = n;
+            if (tx_buff != buffs[0]) {
+                start = StreamStats::nowNs();
+                frames = convertPlayback(buffs[0], n, d_buff_tx.data());
+                d_stats_tx.convert.add(StreamStats::nowNs() - start);
+            }
+            start = StreamStats::nowNs();
+            if (d_mmap_tx) {
+                n_err = snd_pcm_mmap_writei(d_pcm_playback_handle,
+                                            tx_buff,
+                                            frames);
+            } else {
+                n_err = snd_pcm_writei(d_pcm_playback_handle,
+                                       tx_buff,
+                                       frames);
+            }
+            d_stats_tx.transfer.add(StreamStats::nowNs() - start);
             if (n_err > 0) {
+                // The client's elements at its own rate
+                n = d_duc_tx.active() ? n : n_err;
+                d_stats_tx.samples.fetch_add(n, std::memory_order_relaxed);
                 // ok return
                 // printf("write %d\n", n_err);
-                return (int) n_err;
+                return (int) n;
             }  // error, fallthrough
         case SND_PCM_STATE_XRUN:
+            if (snd_state == SND_PCM_STATE_XRUN) {
+                n_err = -EPIPE; // entered in XRUN state
+            }
             if((n_err = snd_pcm_recover(d_pcm_playback_handle, (int) n_err, 0)) == 0) {
                 SoapySDR_logf(SOAPY_SDR_INFO, "writeStream recoverd from underflow");
+                d_stats_tx.xruns.fetch_add(1, std::memory_order_relaxed);
+                prefillPlayback();
                 // Recovered, let Soapy call us again
                 return SOAPY_SDR_UNDERFLOW;
             } else {
                 // could not recover, check error
+                d_stats_tx.recover_failures.fetch_add(1, std::memory_order_relaxed);
                 if ((int)n_err == -EBADFD) {
                     // device was closed
                     SoapySDR_logf(SOAPY_SDR_INFO, "writeStream: snd_pcm_recover: %s", snd_strerror((int)n_err));
@@ -440,115 +1433,1451 @@ int SoapyTujaSDR::writeStream (SoapySDR::Stream *stream,
         case SND_PCM_STATE_SUSPENDED:
         case SND_PCM_STATE_DISCONNECTED:
             // should not end up here.
-            SoapySDR_logf(SOAPY_SDR_ERROR, "bad ALSA state: %s", snd_state);
+            SoapySDR_logf(SOAPY_SDR_ERROR, "bad ALSA state: %s", alsa_state_str(snd_state));
             return SOAPY_SDR_STREAM_ERROR;
     }
 }
 
-
-std::vector<std::string> SoapyTujaSDR::listAntennas(const int direction, const size_t channel) const
+// Start the I/O thread for whatever directions are enabled
+void SoapyTujaSDR::startEngine()
 {
-    SoapySDR_log(SOAPY_SDR_DEBUG, "listAntennas");
-    
-    std::vector<std::string> antennas;
-    antennas.push_back("RF0");
-    // antennas.push_back("TX");
-    return antennas;
+    if (d_engine_running or not (d_engine_rx or d_engine_tx)) {
+        return;
+    }
+    d_engine_running = true;
+    d_engine_thread = std::thread(&SoapyTujaSDR::engineLoop, this);
 }
 
-void SoapyTujaSDR::setAntenna(const int direction, const size_t channel, const std::string &name)
+void SoapyTujaSDR::stopEngine()
 {
-    SoapySDR_log(SOAPY_SDR_DEBUG, "setAntenna");
-    // TODO
+    d_engine_running = false;
+    wakeEngine();
+    if (d_engine_thread.joinable()) {
+        d_engine_thread.join();
+    }
 }
 
-std::string SoapyTujaSDR::getAntenna(const int direction, const size_t channel) const
+void SoapyTujaSDR::wakeEngine()
 {
-    SoapySDR_log(SOAPY_SDR_DEBUG, "getAntenna");
-    return "RF0";
-    // return "TX";
+    const uint64_t one = 1;
+    
+    // EAGAIN means a wakeup is pending already
+    if (write(d_engine_event, &one, sizeof(one)) < 0 and errno != EAGAIN) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "wakeEngine: %s", strerror(errno));
+    }
 }
 
-bool SoapyTujaSDR::hasHardwareTime (const std::string &what) const {
-    return true;
+// Hand a direction to or take it back from the I/O thread. ALSA handles
+// are not thread safe so the thread is stopped while its poll set changes,
+// the other direction rides it out in the ALSA buffer.
+void SoapyTujaSDR::setEngine(const int direction, const bool enable)
+{
+    std::lock_guard<std::mutex> lock(d_engine_mutex);
+    
+    stopEngine();
+    
+    if (direction == SOAPY_SDR_RX) {
+        if (enable) {
+            d_ring_rx->reset();
+            d_overflow_rx = false;
+            d_anchor_queue_rx.clear();
+            d_anchors_rx.clear();
+            d_anchor_pending_rx = false;
+            d_anchored_rx = false;
+            d_engine_anchored_rx = false;
+            d_engine_need_anchor_rx = true;
+        }
+        d_engine_rx = enable;
+    } else {
+        if (enable) {
+            d_ring_tx->reset();
+            d_underflow_tx = false;
+        }
+        d_engine_tx = enable;
+    }
+    
+    startEngine();
 }
 
-long long SoapyTujaSDR::getHardwareTime (const std::string &what) const {
-    return 0LL;
-}
+// Inline streams do their I/O on the caller's thread, give it the
+// configured scheduling the first time we see it.
+void SoapyTujaSDR::realtimeThread(std::thread::id &configured)
+{
+    int err;
+    
+    if (configured == std::this_thread::get_id()) {
+        return;
+    }
+    configured = std::this_thread::get_id();
+    
+    if ((err = rt_thread_setup(&d_rt_config)) < 0) {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "rt_thread_setup %s", strerror(-err));
+    }
+    if (d_rt_config.lock_memory) {
+        rt_prefault_stack(64 * 1024);
+    }
+}
+
+// mlock and prefault everything the stream touches on the hot path. Not
+// fatal, streaming works without, but worth a warning.
+void SoapyTujaSDR::lockBuffers(const int direction)
+{
+    int err = 0;
+    
+    if (not d_rt_config.lock_memory) {
+        return;
+    }
+    
+    // The DSP buffers too, they stay locked when a rate or channel change
+    // on the streaming thread resizes them
+    if (direction == SOAPY_SDR_RX) {
+        err = d_buff_rx.setLocked(true);
+        err = std::min(err, d_ddc_buff_rx.setLocked(true));
+        err = std::min(err, d_fft_buff_rx.setLocked(true));
+        err = std::min(err, d_psd_out_rx.setLocked(true));
+        err = std::min(err, d_scan_power_rx.setLocked(true));
+        err = std::min(err, d_ddc_rx.setLocked(true));
+        err = std::min(err, d_psd_rx.setLocked(true));
+        if (err == 0 and d_ring_rx) {
+            err = d_ring_rx->lock();
+        }
+    } else {
+        err = d_buff_tx.setLocked(true);
+        err = std::min(err, d_duc_buff_tx.setLocked(true));
+        err = std::min(err, d_duc_tx.setLocked(true));
+        if (err == 0 and d_ring_tx) {
+            err = d_ring_tx->lock();
+        }
+    }
+    if (err < 0) {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "setupStream: mlock %s, check ulimit -l", strerror(-err));
+    }
+}
+
+// The rings unlock when they go
+void SoapyTujaSDR::unlockBuffers(const int direction)
+{
+    if (direction == SOAPY_SDR_RX) {
+        d_buff_rx.setLocked(false);
+        d_ddc_buff_rx.setLocked(false);
+        d_fft_buff_rx.setLocked(false);
+        d_psd_out_rx.setLocked(false);
+        d_scan_power_rx.setLocked(false);
+        d_ddc_rx.setLocked(false);
+        d_psd_rx.setLocked(false);
+    } else {
+        d_buff_tx.setLocked(false);
+        d_duc_buff_tx.setLocked(false);
+        d_duc_tx.setLocked(false);
+    }
+}
+
+// Wait for the I/O thread, returns frames available or an error code
+int SoapyTujaSDR::waitCapture(const long timeoutUs, const size_t minFrames)
+{
+    if (d_overflow_rx.exchange(false)) {
+        return SOAPY_SDR_OVERFLOW;
+    }
+    
+    size_t avail = d_ring_rx->readAvailable();
+    if (avail < minFrames) {
+        // Only block when there's nothing to do
+        std::unique_lock<std::mutex> lock(d_ring_mutex_rx);
+        d_ring_cond_rx.wait_for(lock, std::chrono::microseconds(timeoutUs), [this, minFrames] {
+            return d_ring_rx->readAvailable() >= minFrames or d_overflow_rx or not d_engine_rx;
+        });
+        if (d_overflow_rx.exchange(false)) {
+            return SOAPY_SDR_OVERFLOW;
+        }
+        avail = d_ring_rx->readAvailable();
+        if (avail < minFrames) {
+            return d_engine_rx ? SOAPY_SDR_TIMEOUT : SOAPY_SDR_STREAM_ERROR;
+        }
+    }
+    return (int) std::min<size_t>(avail, INT32_MAX);
+}
+
+// Wait for room in the playback ring, returns frames free or an error code
+int SoapyTujaSDR::waitPlayback(const long timeoutUs, const size_t minFrames)
+{
+    if (d_underflow_tx.exchange(false)) {
+        return SOAPY_SDR_UNDERFLOW;
+    }
+    
+    size_t avail = d_ring_tx->writeAvailable();
+    if (avail < minFrames) {
+        std::unique_lock<std::mutex> lock(d_ring_mutex_tx);
+        d_ring_cond_tx.wait_for(lock, std::chrono::microseconds(timeoutUs), [this, minFrames] {
+            return d_ring_tx->writeAvailable() >= minFrames or not d_engine_tx;
+        });
+        avail = d_ring_tx->writeAvailable();
+        if (avail < minFrames) {
+            return d_engine_tx ? SOAPY_SDR_TIMEOUT : SOAPY_SDR_STREAM_ERROR;
+        }
+    }
+    return (int) std::min<size_t>(avail, INT32_MAX);
+}
+
+// Queue numElems written to d_ring_tx, waking the I/O thread if it stopped
+// polling for playback because the ring ran dry.
+void SoapyTujaSDR::commitPlayback(const size_t numElems)
+{
+    d_ring_tx->commitWrite(numElems);
+    // Pairs with the fence in engineLoop, either it sees the samples or we
+    // see it idle.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (d_engine_idle_tx.exchange(false)) {
+        wakeEngine();
+    }
+}
+
+// I/O thread. Polls the PCMs of every enabled direction and services both
+// in the same wakeup.
+void SoapyTujaSDR::engineLoop()
+{
+    std::vector<struct pollfd> pfds;
+    std::vector<short> tx_events;
+    size_t rx_fds = 0;
+    size_t tx_fds = 0;
+    unsigned short revents;
+    uint64_t start;
+    uint64_t count;
+    int err;
+    
+    if ((err = rt_thread_setup(&d_rt_config)) < 0) {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "engineLoop: rt_thread_setup %s", strerror(-err));
+    }
+    if (d_rt_config.lock_memory) {
+        rt_prefault_stack(64 * 1024);
+    }
+    
+    // Wakeup eventfd first, then capture, then playback descriptors
+    pfds.push_back(pollfd());
+    pfds[0].fd = d_engine_event;
+    pfds[0].events = POLLIN;
+    if (d_engine_rx) {
+        rx_fds = snd_pcm_poll_descriptors_count(d_pcm_capture_handle);
+        pfds.resize(1 + rx_fds);
+        snd_pcm_poll_descriptors(d_pcm_capture_handle, &pfds[1], rx_fds);
+        // poll() never fires on a capture PCM that isn't running
+        serviceCapture();
+    }
+    if (d_engine_tx) {
+        tx_fds = snd_pcm_poll_descriptors_count(d_pcm_playback_handle);
+        pfds.resize(1 + rx_fds + tx_fds);
+        snd_pcm_poll_descriptors(d_pcm_playback_handle, &pfds[1 + rx_fds], tx_fds);
+        for (size_t i = 0; i < tx_fds; i++) {
+            tx_events.push_back(pfds[1 + rx_fds + i].events);
+        }
+    }
+    
+    while (d_engine_running and (d_engine_rx or d_engine_tx)) {
+        // A direction that failed is dropped from the poll set
+        if (rx_fds > 0 and not d_engine_rx) {
+            pfds.erase(pfds.begin() + 1, pfds.begin() + 1 + rx_fds);
+            rx_fds = 0;
+        }
+        if (tx_fds > 0 and not d_engine_tx) {
+            pfds.erase(pfds.begin() + 1 + rx_fds, pfds.end());
+            tx_fds = 0;
+        }
+        
+        // Playback is always writable when it isn't full, only ask when
+        // there is something to write or we'd spin.
+        if (tx_fds > 0) {
+            d_engine_idle_tx = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const bool idle = d_ring_tx->readAvailable() == 0;
+            if (not idle) {
+                d_engine_idle_tx = false;
+            }
+            for (size_t i = 0; i < tx_fds; i++) {
+                pfds[1 + rx_fds + i].events = idle ? 0 : tx_events[i];
+            }
+        }
+        
+        start = StreamStats::nowNs();
+        err = poll(pfds.data(), pfds.size(), 100);
+        start = StreamStats::nowNs() - start;
+        if (err < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            SoapySDR_logf(SOAPY_SDR_ERROR, "engineLoop: poll %s", strerror(errno));
+            d_engine_rx = false;
+            d_engine_tx = false;
+            break;
+        }
+        
+        if (pfds[0].revents & POLLIN) {
+            if (read(d_engine_event, &count, sizeof(count)) < 0) {
+                // nothing pending, fine
+            }
+        }
+        if (rx_fds > 0) {
+            d_stats_rx.wait.add(start);
+            snd_pcm_poll_descriptors_revents(d_pcm_capture_handle, &pfds[1], rx_fds, &revents);
+            // also on timeout so a stuck stream gets a kick
+            if (err == 0 or revents & (POLLIN | POLLERR)) {
+                serviceCapture();
+            }
+        }
+        if (tx_fds > 0) {
+            d_stats_tx.wait.add(start);
+            snd_pcm_poll_descriptors_revents(d_pcm_playback_handle, &pfds[1 + rx_fds], tx_fds, &revents);
+            if (revents & (POLLOUT | POLLERR)) {
+                servicePlayback();
+            }
+        }
+    }
+    
+    d_engine_idle_tx = false;
+    // Wake up any reader or writer so they see we stopped
+    { std::lock_guard<std::mutex> lock(d_ring_mutex_rx); }
+    d_ring_cond_rx.notify_one();
+    { std::lock_guard<std::mutex> lock(d_ring_mutex_tx); }
+    d_ring_cond_tx.notify_one();
+}
+
+// Move everything ALSA has captured into d_ring_rx, never blocks
+void SoapyTujaSDR::serviceCapture()
+{
+    snd_pcm_sframes_t avail;
+    snd_pcm_sframes_t n_err = 0;
+    int err;
+    uint64_t start;
+    
+    snd_pcm_state_t snd_state = snd_pcm_state(d_pcm_capture_handle);
+    switch (snd_state) {
+        case SND_PCM_STATE_SETUP:
+            if((err = snd_pcm_prepare(d_pcm_capture_handle)) < 0) {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "serviceCapture: snd_pcm_prepare %s", snd_strerror(err));
+                d_engine_rx = false;
+                break;
+            } // fallthrough
+        case SND_PCM_STATE_PREPARED:
+            if((err = snd_pcm_start(d_pcm_capture_handle)) < 0) {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "serviceCapture: snd_pcm_start %s", snd_strerror(err));
+                d_engine_rx = false;
+                break;
+            } // fallthrough
+        case SND_PCM_STATE_RUNNING:
+            for (;;) {
+                avail = snd_pcm_avail_update(d_pcm_capture_handle);
+                if (avail <= 0) {
+                    n_err = avail;
+                    break;
+                }
+                d_stats_rx.fill.store(avail, std::memory_order_relaxed);
+                size_t frames = std::min<size_t>(std::min<size_t>(avail, d_ring_rx->writeAvailable()),
+                                                 d_config_rx.period_frames);
+                void *dst = d_ring_rx->writePtr();
+                if (frames == 0) {
+                    // Reader is not keeping up, drop a period rather than
+                    // letting ALSA overrun.
+                    d_overflow_rx = true;
+                    d_stats_rx.xruns.fetch_add(1, std::memory_order_relaxed);
+                    d_engine_need_anchor_rx = true;
+                    frames = std::min<size_t>(avail, d_config_rx.period_frames);
+                    dst = d_buff_rx.data();
+                } else if (d_engine_need_anchor_rx and
+                           anchorCapture(d_ring_rx->writeIndex(), d_engine_anchor_rx, d_engine_anchored_rx)) {
+                    std::lock_guard<std::mutex> lock(d_anchor_mutex_rx);
+                    d_anchor_queue_rx.push_back(d_engine_anchor_rx);
+                    d_anchor_pending_rx = true;
+                    d_engine_need_anchor_rx = false;
+                    d_engine_anchored_rx = true;
+                }
+                start = StreamStats::nowNs();
+                if (d_mmap_rx) {
+                    n_err = snd_pcm_mmap_readi(d_pcm_capture_handle, dst, frames);
+                } else {
+                    n_err = snd_pcm_readi(d_pcm_capture_handle, dst, frames);
+                }
+                d_stats_rx.transfer.add(StreamStats::nowNs() - start);
+                if (n_err < 0) {
+                    break;
+                }
+                d_recorder_rx.push((const int32_t *) dst, n_err);
+                if (dst != d_buff_rx.data()) {
+                    d_ring_rx->commitWrite(n_err);
+                    { std::lock_guard<std::mutex> lock(d_ring_mutex_rx); }
+                    d_ring_cond_rx.notify_one();
+                }
+            }
+            if (n_err == 0 or n_err == -EAGAIN) {
+                // drained
+                return;
+            } // error, fallthrough
+        case SND_PCM_STATE_XRUN:
+            if (n_err == 0) {
+                n_err = -EPIPE; // entered in XRUN state
+            }
+            if(snd_pcm_recover(d_pcm_capture_handle, (int) n_err, 0) == 0) {
+                SoapySDR_logf(SOAPY_SDR_INFO, "serviceCapture recoverd from overflow");
+                d_recorder_rx.overrun();
+                d_overflow_rx = true;
+                d_stats_rx.xruns.fetch_add(1, std::memory_order_relaxed);
+                d_engine_need_anchor_rx = true;
+                // poll() never fires on a capture PCM that isn't running
+                if ((err = snd_pcm_start(d_pcm_capture_handle)) < 0) {
+                    SoapySDR_logf(SOAPY_SDR_ERROR, "serviceCapture: snd_pcm_start %s", snd_strerror(err));
+                }
+                break;
+            }
+            SoapySDR_logf(SOAPY_SDR_ERROR, "serviceCapture: snd_pcm_recover: %s",
+                          snd_strerror((int) n_err));
+            d_stats_rx.recover_failures.fetch_add(1, std::memory_order_relaxed);
+            d_engine_rx = false;
+            break;
+        default:
+            SoapySDR_logf(SOAPY_SDR_ERROR, "serviceCapture: bad ALSA state: %s",
+                          alsa_state_str(snd_state));
+            d_engine_rx = false;
+            break;
+    }
+    
+    // Overflowed or stopped, let the reader know
+    { std::lock_guard<std::mutex> lock(d_ring_mutex_rx); }
+    d_ring_cond_rx.notify_one();
+}
 
+// Move queued samples from d_ring_tx to ALSA, never blocks
+void SoapyTujaSDR::servicePlayback()
+{
+    const snd_pcm_uframes_t buffer_frames = d_config_tx.periods * d_config_tx.period_frames;
+    snd_pcm_sframes_t avail;
+    snd_pcm_sframes_t n_err = 0;
+    int err;
+    uint64_t start;
+    
+    snd_pcm_state_t snd_state = snd_pcm_state(d_pcm_playback_handle);
+    switch (snd_state) {
+        case SND_PCM_STATE_SETUP:
+            if((err = snd_pcm_prepare(d_pcm_playback_handle)) < 0) {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "servicePlayback: snd_pcm_prepare %s", snd_strerror(err));
+                d_engine_tx = false;
+                break;
+            } // fallthrough
+        case SND_PCM_STATE_PREPARED:
+            // starts by itself once start_threshold is queued
+        case SND_PCM_STATE_RUNNING:
+            for (;;) {
+                avail = catchUpPlayback(snd_pcm_avail_update(d_pcm_playback_handle));
+                if (avail <= 0) {
+                    n_err = avail;
+                    break;
+                }
+                d_stats_tx.fill.store(buffer_frames - avail, std::memory_order_relaxed);
+                const size_t frames = std::min<size_t>(std::min<size_t>(avail, d_ring_tx->readAvailable()),
+                                                       d_config_tx.period_frames);
+                if (frames == 0) {
+                    return;
+                }
+                start = StreamStats::nowNs();
+                if (d_mmap_tx) {
+                    n_err = snd_pcm_mmap_writei(d_pcm_playback_handle, d_ring_tx->readPtr(), frames);
+                } else {
+                    n_err = snd_pcm_writei(d_pcm_playback_handle, d_ring_tx->readPtr(), frames);
+                }
+                d_stats_tx.transfer.add(StreamStats::nowNs() - start);
+                if (n_err < 0) {
+                    break;
+                }
+                d_ring_tx->commitRead(n_err);
+                { std::lock_guard<std::mutex> lock(d_ring_mutex_tx); }
+                d_ring_cond_tx.notify_one();
+            }
+            if (n_err == 0 or n_err == -EAGAIN) {
+                // full
+                return;
+            } // error, fallthrough
+        case SND_PCM_STATE_XRUN:
+            if (n_err == 0) {
+                n_err = -EPIPE; // entered in XRUN state
+            }
+            if(snd_pcm_recover(d_pcm_playback_handle, (int) n_err, 0) == 0) {
+                SoapySDR_logf(SOAPY_SDR_INFO, "servicePlayback recoverd from underflow");
+                d_underflow_tx = true;
+                d_stats_tx.xruns.fetch_add(1, std::memory_order_relaxed);
+                prefillPlayback();
+                break;
+            }
+            SoapySDR_logf(SOAPY_SDR_ERROR, "servicePlayback: snd_pcm_recover: %s",
+                          snd_strerror((int) n_err));
+            d_stats_tx.recover_failures.fetch_add(1, std::memory_order_relaxed);
+            d_engine_tx = false;
+            break;
+        default:
+            SoapySDR_logf(SOAPY_SDR_ERROR, "servicePlayback: bad ALSA state: %s",
+                          alsa_state_str(snd_state));
+            d_engine_tx = false;
+            break;
+    }
+    
+    // Underflowed or stopped, let the writer know
+    { std::lock_guard<std::mutex> lock(d_ring_mutex_tx); }
+    d_ring_cond_tx.notify_one();
+}
+
+// Link once both streams exist and TX asked for it
+void SoapyTujaSDR::linkStreams()
+{
+    int err;
+    
+    if (d_linked or not d_link_tx or
+        d_pcm_capture_handle == nullptr or d_pcm_playback_handle == nullptr) {
+        return;
+    }
+    if ((err = snd_pcm_link(d_pcm_capture_handle, d_pcm_playback_handle)) < 0) {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "snd_pcm_link %s, RX and TX start independently",
+                      snd_strerror(err));
+        return;
+    }
+    d_linked = true;
+}
+
+void SoapyTujaSDR::unlinkStreams()
+{
+    if (d_linked) {
+        snd_pcm_unlink(d_pcm_capture_handle);
+        d_linked = false;
+    }
+}
+
+// Free running playback carries on, playing silence, when we fall behind.
+// Skip what was missed so new samples play now rather than in the past,
+// keeping prefill (at least a period) of the silence ahead as a cushion.
+snd_pcm_sframes_t SoapyTujaSDR::catchUpPlayback(const snd_pcm_sframes_t avail)
+{
+    const snd_pcm_sframes_t buffer_frames = d_config_tx.periods * d_config_tx.period_frames;
+    const snd_pcm_sframes_t cushion = std::max(d_prefill_tx, d_config_tx.period_frames);
+    
+    if (not d_config_tx.free_run or avail <= buffer_frames) {
+        return avail;
+    }
+    const snd_pcm_sframes_t skipped = snd_pcm_forward(d_pcm_playback_handle,
+                                                      avail - buffer_frames + cushion);
+    if (skipped < 0) {
+        return skipped;
+    }
+    d_stats_tx.xruns.fetch_add(1, std::memory_order_relaxed);
+    d_stats_tx.inserted.fetch_add(skipped, std::memory_order_relaxed);
+    if (d_threaded_tx) {
+        d_underflow_tx = true;
+    }
+    return avail - skipped;
+}
+
+// Queue prefill frames of silence. At or above the start threshold
+// playback starts right away and has that much to play while the
+// client catches up.
+int SoapyTujaSDR::prefillPlayback()
+{
+    snd_pcm_uframes_t left = d_prefill_tx;
+    snd_pcm_sframes_t n_err;
+    
+    std::fill(d_buff_tx.data(), d_buff_tx.data() + d_buff_tx.size(), 0);
+    while (left > 0) {
+        const snd_pcm_uframes_t n = std::min(left, d_config_tx.period_frames);
+        if (d_mmap_tx) {
+            n_err = snd_pcm_mmap_writei(d_pcm_playback_handle, d_buff_tx.data(), n);
+        } else {
+            n_err = snd_pcm_writei(d_pcm_playback_handle, d_buff_tx.data(), n);
+        }
+        if (n_err < 0) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "prefillPlayback: %s", snd_strerror((int) n_err));
+            return (int) n_err;
+        }
+        left -= n_err;
+    }
+    return 0;
+}
+
+// Play the probe on TX and find it on RX. Both streams must be set up and
+// inactive, they are linked for the measurement so capture index and
+// playback position count from the same instant.
+long SoapyTujaSDR::calibrateLatency()
+{
+    if (d_pcm_capture_handle == nullptr or d_pcm_playback_handle == nullptr) {
+        throw std::runtime_error("calibrate needs both RX and TX streams set up");
+    }
+    if (d_active_rx or d_active_tx) {
+        throw std::runtime_error("calibrate needs the streams deactivated");
+    }
+    
+    const bool linked = d_linked;
+    snd_pcm_sframes_t n_err = 0;
+    
+    if (not linked and (n_err = snd_pcm_link(d_pcm_capture_handle, d_pcm_playback_handle)) < 0) {
+        throw std::runtime_error("calibrate: snd_pcm_link: " + std::string(snd_strerror((int) n_err)));
+    }
+    // The I/O thread opens them non blocking
+    snd_pcm_nonblock(d_pcm_capture_handle, 0);
+    snd_pcm_nonblock(d_pcm_playback_handle, 0);
+    
+    LatencyProbe probe;
+    const size_t channels = (size_t) d_channels;
+    const size_t period_rx = d_config_rx.period_frames;
+    const size_t period_tx = d_config_tx.period_frames;
+    const size_t buffer_rx = d_config_rx.periods * period_rx;
+    const size_t buffer_tx = d_config_tx.periods * period_tx;
+    // The probe starts a period in and can't be later than both buffers
+    // plus the analog path, look twice that far.
+    const long lead = period_tx;
+    const size_t window = lead + probe.length() + 2 * (buffer_rx + buffer_tx);
+    VolkBuffer<int32_t> capture;
+    VolkBuffer<int32_t> playback;
+    capture.assign(channels * window, 0);
+    playback.assign(channels * period_tx, 0);
+    
+    size_t captured = 0;
+    size_t played = 0;
+    auto play = [&]() {
+        probe.generate(playback.data(), (long) played - lead, period_tx);
+        n_err = d_mmap_tx ?
+        snd_pcm_mmap_writei(d_pcm_playback_handle, playback.data(), period_tx) :
+        snd_pcm_writei(d_pcm_playback_handle, playback.data(), period_tx);
+        if (n_err > 0) {
+            played += n_err;
+        }
+    };
+    
+    // Linked, preparing one prepares both but be explicit
+    snd_pcm_prepare(d_pcm_capture_handle);
+    snd_pcm_prepare(d_pcm_playback_handle);
+    // Filling playback starts both at the start threshold
+    while (n_err >= 0 and played < buffer_tx) {
+        play();
+    }
+    if (n_err >= 0 and snd_pcm_state(d_pcm_capture_handle) == SND_PCM_STATE_PREPARED) {
+        n_err = snd_pcm_start(d_pcm_capture_handle);
+    }
+    while (n_err >= 0 and captured < window) {
+        const size_t frames = std::min(period_rx, window - captured);
+        int32_t *dst = capture.data() + channels * captured;
+        n_err = d_mmap_rx ?
+        snd_pcm_mmap_readi(d_pcm_capture_handle, dst, frames) :
+        snd_pcm_readi(d_pcm_capture_handle, dst, frames);
+        if (n_err > 0) {
+            captured += n_err;
+            // keep playback queued without blocking capture
+            if (snd_pcm_avail_update(d_pcm_playback_handle) >= (snd_pcm_sframes_t) period_tx) {
+                play();
+            }
+        }
+    }
+    
+    snd_pcm_drop(d_pcm_capture_handle);
+    snd_pcm_drop(d_pcm_playback_handle);
+    snd_pcm_nonblock(d_pcm_capture_handle, d_config_rx.mode & SND_PCM_NONBLOCK ? 1 : 0);
+    snd_pcm_nonblock(d_pcm_playback_handle, d_config_tx.mode & SND_PCM_NONBLOCK ? 1 : 0);
+    if (not linked) {
+        snd_pcm_unlink(d_pcm_capture_handle);
+    }
+    
+    d_latency = -1;
+    if (n_err < 0) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "calibrate: %s", snd_strerror((int) n_err));
+        return d_latency;
+    }
+    
+    VolkBuffer<std::complex<float>> samples;
+    samples.assign(window, 0);
+    volk_32i_s32f_convert_32f((float *) samples.data(), capture.data(), 1u << 31, channels * window);
+    
+    float quality;
+    const long found = probe.correlate(samples.data(), window, quality);
+    if (found < 0) {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "calibrate: probe not found on RX, is TX looped back? (peak %.1f)",
+                      quality);
+        return d_latency;
+    }
+    d_latency = found - lead;
+    SoapySDR_logf(SOAPY_SDR_INFO, "calibrate: round trip latency %ld samples, %.3f ms (peak %.1f)",
+                  d_latency, 1e3 * d_latency / d_sample_rate, quality);
+    return d_latency;
+}
+
+// Anchor index to the last hardware timestamp, never going back in time
+// relative to the previous anchor when clamp is set.
+bool SoapyTujaSDR::anchorCapture(const uint64_t index, TimeAnchor &anchor, const bool clamp)
+{
+    snd_pcm_uframes_t avail;
+    snd_htimestamp_t tstamp;
+    
+    if (snd_pcm_htimestamp(d_pcm_capture_handle, &avail, &tstamp) < 0) {
+        return false;
+    }
+    if (tstamp.tv_sec == 0 and tstamp.tv_nsec == 0) {
+        // no period elapsed yet
+        return false;
+    }
+    
+    // tstamp is when the hw pointer was at index + avail
+    long long timeNs = tstamp.tv_sec * 1000000000LL + tstamp.tv_nsec -
+    SoapySDR::ticksToTimeNs(avail, d_sample_rate);
+    
+    if (clamp) {
+        // Samples were lost so real time has moved on at least this far
+        timeNs = std::max(timeNs, anchor.timeNs +
+                          SoapySDR::ticksToTimeNs(index - anchor.index, d_sample_rate));
+    }
+    
+    anchor.index = index;
+    anchor.timeNs = timeNs;
+    return true;
+}
+
+// Timestamp a block read from the capture ring. Returns numElems limited so
+// a block never spans a discontinuity.
+size_t SoapyTujaSDR::timeCapture(const uint64_t index, const size_t numElems, int &flags, long long &timeNs)
+{
+    if (d_anchor_pending_rx) {
+        std::lock_guard<std::mutex> lock(d_anchor_mutex_rx);
+        d_anchors_rx.insert(d_anchors_rx.end(), d_anchor_queue_rx.begin(), d_anchor_queue_rx.end());
+        d_anchor_queue_rx.clear();
+        d_anchor_pending_rx = false;
+    }
+    
+    while (not d_anchors_rx.empty() and d_anchors_rx.front().index <= index) {
+        d_anchor_rx = d_anchors_rx.front();
+        d_anchors_rx.pop_front();
+        d_anchored_rx = true;
+    }
+    
+    size_t n = numElems;
+    if (not d_anchors_rx.empty()) {
+        n = std::min<size_t>(n, d_anchors_rx.front().index - index);
+    }
+    
+    if (d_anchored_rx) {
+        timeNs = d_anchor_rx.timeNs + SoapySDR::ticksToTimeNs(index - d_anchor_rx.index, d_sample_rate);
+        flags |= SOAPY_SDR_HAS_TIME;
+    }
+    return n;
+}
+
+// Flag the first block that reaches the time of the last retune. Without
+// a timestamp that's the first block read after it.
+void SoapyTujaSDR::retunedCapture(const long long timeNs, const size_t numFrames, int &flags)
+{
+    const long long tunedNs = d_tuned_ns.load(std::memory_order_relaxed);
+    if (tunedNs == d_retune_reported_rx) {
+        return;
+    }
+    if ((flags & SOAPY_SDR_HAS_TIME) and
+        tunedNs >= timeNs + SoapySDR::ticksToTimeNs(numFrames, d_sample_rate)) {
+        return;
+    }
+    flags |= SOAPY_SDR_USER_FLAG0;
+    d_retune_reported_rx = tunedNs;
+}
+
+// Pick up sample rate, BB frequency, front end correction and gain changes
+void SoapyTujaSDR::applyDdc()
+{
+    if (d_ddc_changed_rx.exchange(false)) {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        IqCorrector &frontend = d_ddc_rx.frontend();
+        frontend.setAutoDcOffset(d_dc_offset_auto_rx);
+        frontend.setDcOffset(lv_cmake((float) d_dc_offset_rx.real(), (float) d_dc_offset_rx.imag()));
+        frontend.setAutoBalance(d_iq_balance_auto_rx);
+        frontend.setBalance(lv_cmake((float) d_iq_balance_rx.real(), (float) d_iq_balance_rx.imag()));
+        // Spectra are in dBFS of the signal, scans also see the whole
+        // capture as it is
+        const bool fft = d_scan_rx or d_spectrum_rx;
+        d_agc_rx.setAutomatic(d_gain_auto_rx and not fft);
+        d_agc_rx.setGain(fft ? 0 : d_gain_rx);
+        d_ddc_rx.setDecimation(d_scan_rx ? 1 : d_decimation_rx);
+        for (size_t i = 0; i < d_stream_channels_rx.size(); i++) {
+            // the NCO moves +BB down to DC
+            d_ddc_rx.setOffset(i, d_scan_rx ? 0 : -d_bb_frequency_rx[d_stream_channels_rx[i]] / d_sample_rate);
+        }
+    }
+}
+
+// Downconvert, if needed, and convert captured CS32 frames into the client
+// buffers, one per stream channel. Returns elements written per channel,
+// offset is the capture frame the first one is centered on relative to the
+// first frame, for timestamps.
+size_t SoapyTujaSDR::convertCapture(const void *capture, const size_t numFrames, void * const *outs,
+                                    long long &offset, int &flags)
+{
+    const size_t numChannels = d_stream_channels_rx.size();
+    const bool ddc = d_ddc_rx.active();
+    size_t n = numFrames;
+    
+    offset = 0;
+    if (ddc) {
+        offset = (long long) d_ddc_rx.phase() - (long long) d_ddc_rx.delay();
+        for (size_t i = 0; i < numChannels; i++) {
+            d_ddc_outs_rx[i] = d_native_rx ? (int32_t *) outs[i] :
+            d_ddc_buff_rx.data() + i * (size_t) d_channels * d_config_rx.period_frames;
+        }
+        n = d_ddc_rx.process((const int32_t *) capture, numFrames, d_ddc_outs_rx.data());
+    }
+    float peak = 0;
+    if (d_agc_rx.automatic() or d_bfp_rx) {
+        // Measured on what is about to be converted, so the gain is down
+        // before a loud block clips
+        for (size_t i = 0; i < (ddc ? numChannels : 1); i++) {
+            const int32_t *src = ddc ? d_ddc_outs_rx[i] : (const int32_t *) capture;
+            peak = std::max(peak, Agc::peak(src, n * (size_t) d_channels));
+        }
+        d_agc_rx.update(peak, numFrames / d_sample_rate);
+    }
+    double scale = d_agc_rx.scale();
+    if (d_bfp_rx) {
+        // Shift the block up as far as it goes, the exponent fits the four
+        // user flags above the retune flag
+        int exponent = 0;
+        while (exponent < 15 and peak * scale * 2 <= 1.0) {
+            scale *= 2;
+            exponent++;
+        }
+        flags |= exponent * SOAPY_SDR_USER_FLAG1;
+    }
+    for (size_t i = 0; i < numChannels; i++) {
+        // Native reads may already be in the client buffer, then only
+        // the gain is left to apply, in place
+        const void *src = ddc ? d_ddc_outs_rx[i] : capture;
+        if (src != outs[i] or scale != 1.0) {
+            d_converter_func_rx(src, outs[i], n, scale);
+        }
+    }
+    
+    // Hand the estimates to getDCOffset, getIQBalance and getGain. Skipped
+    // if the lock is busy, or a new setting would be overwritten.
+    const IqCorrector &frontend = d_ddc_rx.frontend();
+    if (frontend.autoDcOffset() or frontend.autoBalance() or d_agc_rx.automatic()) {
+        std::unique_lock<std::mutex> lock(d_ddc_mutex, std::try_to_lock);
+        if (lock.owns_lock() and not d_ddc_changed_rx) {
+            d_dc_offset_rx = frontend.dcOffset();
+            d_iq_balance_rx = frontend.balance();
+            d_gain_rx = d_agc_rx.gain();
+        }
+    }
+    return n;
+}
+
+// Pick up TX sample rate and BB frequency changes
+void SoapyTujaSDR::applyDuc()
+{
+    if (d_duc_changed_tx.exchange(false)) {
+        std::lock_guard<std::mutex> lock(d_duc_mutex);
+        d_duc_tx.setInterpolation(d_interpolation_tx);
+        // the NCO moves DC up to +BB
+        d_duc_tx.setOffset(d_bb_frequency_tx / d_sample_rate);
+    }
+}
+
+// Convert client samples to native CS32 and upconvert, if needed, to the
+// hardware rate. Returns frames written to out.
+size_t SoapyTujaSDR::convertPlayback(const void *buff, const size_t numElems, int32_t *out)
+{
+    if (not d_duc_tx.active()) {
+        d_converter_func_tx(buff, out, numElems, 1.0);
+        return numElems;
+    }
+    // Native samples go into the DUC as they are
+    const int32_t *in = (const int32_t *) buff;
+    if (not d_native_tx) {
+        d_converter_func_tx(buff, d_duc_buff_tx.data(), numElems, 1.0);
+        in = d_duc_buff_tx.data();
+    }
+    return d_duc_tx.process(in, numElems, out);
+}
+
+size_t SoapyTujaSDR::getNumDirectAccessBuffers(SoapySDR::Stream *stream)
+{
+    const int direction = *reinterpret_cast<int *>(stream);
+    
+    // Only one buffer is handed out at a time in each direction, always
+    // handle 0, release commits the one acquired last
+    if (direction == SOAPY_SDR_RX and d_direct_rx) {
+        return 1;
+    }
+    if (direction == SOAPY_SDR_TX and d_direct_tx) {
+        return 1;
+    }
+    return 0;
+}
+
+int SoapyTujaSDR::acquireReadBuffer(SoapySDR::Stream *stream,
+                                    size_t &handle,
+                                    const void **buffs,
+                                    int &flags,
+                                    long long &timeNs,
+                                    const long timeoutUs)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_sframes_t avail = 0;
+    int err = 0;
+    uint64_t start;
+    
+    if (d_pcm_capture_handle == nullptr or not d_direct_rx) {
+        return SOAPY_SDR_NOT_SUPPORTED;
+    }
+    // The buffers handed out are at the hardware rate, without gain
+    applyDdc();
+    if (d_ddc_rx.active() or d_agc_rx.automatic() or d_agc_rx.scale() != 1.0) {
+        return SOAPY_SDR_NOT_SUPPORTED;
+    }
+    
+    if (d_threaded_rx) {
+        // Hand out the capture ring instead of the DMA ring
+        if ((err = waitCapture(timeoutUs)) <= 0) {
+            return err;
+        }
+        d_mmap_frames_rx = timeCapture(d_ring_rx->readIndex(),
+                                       std::min<snd_pcm_uframes_t>(err, d_config_rx.period_frames),
+                                       flags, timeNs);
+        retunedCapture(timeNs, d_mmap_frames_rx, flags);
+        buffs[0] = d_ring_rx->readPtr();
+        handle = 0;
+        return (int) d_mmap_frames_rx;
+    }
+    
+    realtimeThread(d_rt_thread_rx);
+    snd_pcm_state_t snd_state = snd_pcm_state(d_pcm_capture_handle);
+    switch (snd_state) {
+        case SND_PCM_STATE_SETUP:
+            if((err = snd_pcm_prepare(d_pcm_capture_handle)) < 0) {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "acquireReadBuffer: snd_pcm_prepare %s", snd_strerror(err));
+                return SOAPY_SDR_STREAM_ERROR;
+            } // fallthrough
+        case SND_PCM_STATE_PREPARED:
+            if((err = snd_pcm_start(d_pcm_capture_handle)) < 0) {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "acquireReadBuffer: snd_pcm_start %s", snd_strerror(err));
+                return SOAPY_SDR_STREAM_ERROR;
+            }
+            d_need_anchor_rx = true; // fallthrough
+        case SND_PCM_STATE_RUNNING:
+            // also syncs the hw pointer which mmap_begin relies on
+            avail = snd_pcm_avail_update(d_pcm_capture_handle);
+            if (avail == 0) {
+                start = StreamStats::nowNs();
+                err = snd_pcm_wait(d_pcm_capture_handle, int(timeoutUs / 1000));
+                d_stats_rx.wait.add(StreamStats::nowNs() - start);
+                if(err == 0) {
+                    return SOAPY_SDR_TIMEOUT;
+                }
+                avail = snd_pcm_avail_update(d_pcm_capture_handle);
+            }
+            if (avail >= 0) {
+                d_stats_rx.fill.store(avail, std::memory_order_relaxed);
+            }
+            if (avail > 0 and d_need_anchor_rx) {
+                d_need_anchor_rx = not anchorCapture(d_sample_index_rx, d_anchor_rx, d_anchored_rx);
+                d_anchored_rx = d_anchored_rx or not d_need_anchor_rx;
+            }
+            if (avail > 0) {
+                // Never hand out more than a period, the area is contiguous
+                // up to the end of the ring anyway.
+                d_mmap_frames_rx = std::min<snd_pcm_uframes_t>(avail, d_config_rx.period_frames);
+                err = snd_pcm_mmap_begin(d_pcm_capture_handle,
+                                         &areas,
+                                         &d_mmap_offset_rx,
+                                         &d_mmap_frames_rx);
+                if (err == 0) {
+                    // I and Q are interleaved so channel 0 points at the frame
+                    buffs[0] = (const char *)areas[0].addr +
+                    areas[0].first / 8 + d_mmap_offset_rx * (areas[0].step / 8);
+                    handle = 0;
+                    d_recorder_rx.push((const int32_t *) buffs[0], d_mmap_frames_rx);
+                    if (d_anchored_rx) {
+                        timeNs = d_anchor_rx.timeNs +
+                        SoapySDR::ticksToTimeNs(d_sample_index_rx - d_anchor_rx.index, d_sample_rate);
+                        flags |= SOAPY_SDR_HAS_TIME;
+                    }
+                    retunedCapture(timeNs, d_mmap_frames_rx, flags);
+                    return (int) d_mmap_frames_rx;
+                }
+                avail = err;
+            } // error, fallthrough
+        case SND_PCM_STATE_XRUN:
+            if (avail == 0) {
+                avail = -EPIPE; // entered in XRUN state
+            }
+            if(snd_pcm_recover(d_pcm_capture_handle, (int) avail, 0) == 0) {
+                SoapySDR_logf(SOAPY_SDR_INFO, "acquireReadBuffer recoverd from overflow");
+                d_recorder_rx.overrun();
+                d_stats_rx.xruns.fetch_add(1, std::memory_order_relaxed);
+                d_need_anchor_rx = true;
+                return SOAPY_SDR_OVERFLOW;
+            }
+            SoapySDR_logf(SOAPY_SDR_ERROR, "acquireReadBuffer: snd_pcm_recover: %s",
+                          snd_strerror((int) avail));
+            d_stats_rx.recover_failures.fetch_add(1, std::memory_order_relaxed);
+            return SOAPY_SDR_STREAM_ERROR;
+        default:
+            SoapySDR_logf(SOAPY_SDR_ERROR, "acquireReadBuffer: bad ALSA state: %s",
+                          alsa_state_str(snd_state));
+            return SOAPY_SDR_STREAM_ERROR;
+    }
+}
+
+void SoapyTujaSDR::releaseReadBuffer(SoapySDR::Stream *stream, const size_t handle)
+{
+    snd_pcm_sframes_t n_err;
+    
+    if (d_pcm_capture_handle == nullptr) {
+        return;
+    }
+    
+    if (d_threaded_rx) {
+        d_ring_rx->commitRead(d_mmap_frames_rx);
+        d_stats_rx.samples.fetch_add(d_mmap_frames_rx, std::memory_order_relaxed);
+        d_mmap_frames_rx = 0;
+        return;
+    }
+    
+    // Hand the period back to the hardware
+    n_err = snd_pcm_mmap_commit(d_pcm_capture_handle, d_mmap_offset_rx, d_mmap_frames_rx);
+    d_sample_index_rx += d_mmap_frames_rx;
+    d_stats_rx.samples.fetch_add(d_mmap_frames_rx, std::memory_order_relaxed);
+    if (n_err < 0 or (snd_pcm_uframes_t) n_err != d_mmap_frames_rx) {
+        // overrun while the buffer was held, next acquire recovers
+        SoapySDR_logf(SOAPY_SDR_INFO, "releaseReadBuffer: snd_pcm_mmap_commit %s",
+                      n_err < 0 ? snd_strerror((int) n_err) : "short commit");
+    }
+    d_mmap_frames_rx = 0;
+}
+
+int SoapyTujaSDR::acquireWriteBuffer(SoapySDR::Stream *stream,
+                                     size_t &handle,
+                                     void **buffs,
+                                     const long timeoutUs)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_sframes_t avail = 0;
+    int err = 0;
+    uint64_t start;
+    
+    if (d_pcm_playback_handle == nullptr or not d_direct_tx) {
+        return SOAPY_SDR_NOT_SUPPORTED;
+    }
+    // The buffers handed out are at the hardware rate
+    applyDuc();
+    if (d_duc_tx.active()) {
+        return SOAPY_SDR_NOT_SUPPORTED;
+    }
+    
+    if (d_threaded_tx) {
+        // Hand out the playback ring instead of the DMA ring
+        if ((err = waitPlayback(timeoutUs)) <= 0) {
+            return err;
+        }
+        d_mmap_frames_tx = std::min<snd_pcm_uframes_t>(err, d_config_tx.period_frames);
+        buffs[0] = d_ring_tx->writePtr();
+        handle = 0;
+        return (int) d_mmap_frames_tx;
+    }
+    
+    realtimeThread(d_rt_thread_tx);
+    snd_pcm_state_t snd_state = snd_pcm_state(d_pcm_playback_handle);
+    switch (snd_state) {
+        case SND_PCM_STATE_SETUP:
+            if((err = snd_pcm_prepare(d_pcm_playback_handle)) < 0) {
+                SoapySDR_logf(SOAPY_SDR_ERROR, "acquireWriteBuffer: snd_pcm_prepare %s", snd_strerror(err));
+                return SOAPY_SDR_STREAM_ERROR;
+            } // fallthrough
+        case SND_PCM_STATE_PREPARED:
+            // not started, releaseWriteBuffer starts it at the start threshold
+        case SND_PCM_STATE_RUNNING:
+            avail = snd_pcm_avail_update(d_pcm_playback_handle);
+            if (avail == 0) {
+                start = StreamStats::nowNs();
+                err = snd_pcm_wait(d_pcm_playback_handle, int(timeoutUs / 1000));
+                d_stats_tx.wait.add(StreamStats::nowNs() - start);
+                if(err == 0) {
+                    return SOAPY_SDR_TIMEOUT;
+                }
+                avail = snd_pcm_avail_update(d_pcm_playback_handle);
+            }
+            avail = catchUpPlayback(avail);
+            if (avail >= 0) {
+                d_stats_tx.fill.store(d_config_tx.periods * d_config_tx.period_frames - avail,
+                                      std::memory_order_relaxed);
+            }
+            if (avail > 0) {
+                d_mmap_frames_tx = std::min<snd_pcm_uframes_t>(avail, d_config_tx.period_frames);
+                err = snd_pcm_mmap_begin(d_pcm_playback_handle,
+                                         &areas,
+                                         &d_mmap_offset_tx,
+                                         &d_mmap_frames_tx);
+                if (err == 0) {
+                    buffs[0] = (char *)areas[0].addr +
+                    areas[0].first / 8 + d_mmap_offset_tx * (areas[0].step / 8);
+                    handle = 0;
+                    return (int) d_mmap_frames_tx;
+                }
+                avail = err;
+            } // error, fallthrough
+        case SND_PCM_STATE_XRUN:
+            if (avail == 0) {
+                avail = -EPIPE; // entered in XRUN state
+            }
+            if(snd_pcm_recover(d_pcm_playback_handle, (int) avail, 0) == 0) {
+                SoapySDR_logf(SOAPY_SDR_INFO, "acquireWriteBuffer recoverd from underflow");
+                d_stats_tx.xruns.fetch_add(1, std::memory_order_relaxed);
+                prefillPlayback();
+                return SOAPY_SDR_UNDERFLOW;
+            }
+            SoapySDR_logf(SOAPY_SDR_ERROR, "acquireWriteBuffer: snd_pcm_recover: %s",
+                          snd_strerror((int) avail));
+            d_stats_tx.recover_failures.fetch_add(1, std::memory_order_relaxed);
+            return SOAPY_SDR_STREAM_ERROR;
+        default:
+            SoapySDR_logf(SOAPY_SDR_ERROR, "acquireWriteBuffer: bad ALSA state: %s",
+                          alsa_state_str(snd_state));
+            return SOAPY_SDR_STREAM_ERROR;
+    }
+}
+
+void SoapyTujaSDR::releaseWriteBuffer(SoapySDR::Stream *stream,
+                                      const size_t handle,
+                                      const size_t numElems,
+                                      int &flags,
+                                      const long long timeNs)
+{
+    snd_pcm_sframes_t n_err;
+    int err;
+    
+    if (d_pcm_playback_handle == nullptr) {
+        return;
+    }
+    
+    if (d_threaded_tx) {
+        const size_t n = std::min<size_t>(numElems, d_mmap_frames_tx);
+        commitPlayback(n);
+        d_stats_tx.samples.fetch_add(n, std::memory_order_relaxed);
+        d_mmap_frames_tx = 0;
+        return;
+    }
+    
+    // The client may have filled less than it was given
+    n_err = snd_pcm_mmap_commit(d_pcm_playback_handle,
+                                d_mmap_offset_tx,
+                                std::min<snd_pcm_uframes_t>(numElems, d_mmap_frames_tx));
+    d_mmap_frames_tx = 0;
+    if (n_err < 0) {
+        SoapySDR_logf(SOAPY_SDR_INFO, "releaseWriteBuffer: snd_pcm_mmap_commit %s",
+                      snd_strerror((int) n_err));
+        return;
+    }
+    d_stats_tx.samples.fetch_add(n_err, std::memory_order_relaxed);
+    
+    // mmap_commit does not honour the start threshold like writei does,
+    // start once that much is queued.
+    if (snd_pcm_state(d_pcm_playback_handle) == SND_PCM_STATE_PREPARED and
+        (n_err = snd_pcm_avail_update(d_pcm_playback_handle)) >= 0 and
+        d_config_tx.periods * d_config_tx.period_frames - n_err >= d_config_tx.start_threshold) {
+        if ((err = snd_pcm_start(d_pcm_playback_handle)) < 0) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "releaseWriteBuffer: snd_pcm_start %s", snd_strerror(err));
+        }
+    }
+}
+
+std::vector<std::string> SoapyTujaSDR::listAntennas(const int direction, const size_t channel) const
+{
+    SoapySDR_log(SOAPY_SDR_DEBUG, "listAntennas");
+    
+    std::vector<std::string> antennas;
+    antennas.push_back("RF0");
+    // antennas.push_back("TX");
+    return antennas;
+}
+
+void SoapyTujaSDR::setAntenna(const int direction, const size_t channel, const std::string &name)
+{
+    SoapySDR_log(SOAPY_SDR_DEBUG, "setAntenna");
+    // TODO
+}
+
+std::string SoapyTujaSDR::getAntenna(const int direction, const size_t channel) const
+{
+    SoapySDR_log(SOAPY_SDR_DEBUG, "getAntenna");
+    return "RF0";
+    // return "TX";
+}
+
+bool SoapyTujaSDR::hasHardwareTime (const std::string &what) const {
+    return true;
+}
+
+// ALSA timestamps are CLOCK_MONOTONIC so that is our hardware time
+long long SoapyTujaSDR::getHardwareTime (const std::string &what) const {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Streaming health, see streamstats.hpp. Durations are log2 histograms.
 std::vector<std::string> SoapyTujaSDR::listSensors (void) const {
     std::vector<std::string> sensors;
+    sensors.push_back("rx_samples");
+    sensors.push_back("rx_overflows");
+    sensors.push_back("rx_recover_failures");
+    sensors.push_back("rx_fill");
+    sensors.push_back("rx_wait");
+    sensors.push_back("rx_transfer");
+    sensors.push_back("rx_convert");
+    sensors.push_back("tx_samples");
+    sensors.push_back("tx_underflows");
+    sensors.push_back("tx_inserted");
+    sensors.push_back("tx_recover_failures");
+    sensors.push_back("tx_fill");
+    sensors.push_back("tx_wait");
+    sensors.push_back("tx_transfer");
+    sensors.push_back("tx_convert");
+    sensors.push_back("rf_tuned");
+    sensors.push_back("scan_axis");
     return sensors;
 }
 
+SoapySDR::ArgInfo SoapyTujaSDR::getSensorInfo (const std::string &key) const {
+    SoapySDR::ArgInfo info;
+    const bool rx = key.compare(0, 3, "rx_") == 0;
+    const std::string name = key.substr(std::min<size_t>(3, key.size()));
+    
+    info.key = key;
+    info.type = SoapySDR::ArgInfo::INT;
+    if (key == "rf_tuned") {
+        info.name = "RF tuned";
+        info.description = "The last RF frequency to take effect and when, in RX timestamp time.";
+        info.type = SoapySDR::ArgInfo::STRING;
+    } else if (key == "scan_axis") {
+        info.name = "Scan axis";
+        info.description = "Frequency of the first bin, bin spacing and bins per sweep in scan mode.";
+        info.type = SoapySDR::ArgInfo::STRING;
+    } else if (name == "samples") {
+        info.name = rx ? "RX samples" : "TX samples";
+        info.description = "Samples transferred since setupStream.";
+        info.units = "samples";
+    } else if (name == "overflows" or name == "underflows") {
+        info.name = rx ? "RX overflows" : "TX underflows";
+        info.description = "XRUNs recovered from, each one lost samples.";
+    } else if (name == "inserted") {
+        info.name = "TX silence inserted";
+        info.description = "Frames of silence played because samples came late, with underrun=fill or link=true.";
+        info.units = "frames";
+    } else if (name == "recover_failures") {
+        info.name = "Recover failures";
+        info.description = "XRUNs snd_pcm_recover could not recover from.";
+    } else if (name == "fill") {
+        info.name = rx ? "RX fill level" : "TX fill level";
+        info.description = rx ? "Captured frames waiting in the ALSA buffer, last seen." :
+        "Frames queued for playback in the ALSA buffer, last seen.";
+        info.units = "frames";
+        const alsa_config_t &config = rx ? d_config_rx : d_config_tx;
+        info.range = SoapySDR::Range(0, config.periods * config.period_frames);
+    } else if (name == "wait" or name == "transfer" or name == "convert") {
+        info.name = name == "wait" ? "snd_pcm_wait time" :
+        name == "transfer" ? (rx ? "snd_pcm_readi time" : "snd_pcm_writei time") : "Converter time";
+        info.description = "Histogram, bucket i counts durations in [2^(i-1), 2^i) ns.";
+        info.units = "ns";
+        info.type = SoapySDR::ArgInfo::STRING;
+    }
+    return info;
+}
+
+std::string SoapyTujaSDR::readSensor (const std::string &key) const {
+    if (key == "rf_tuned") {
+        std::lock_guard<std::mutex> lock(d_tune_mutex);
+        char line[64];
+        snprintf(line, sizeof(line), "frequency=%.0f time_ns=%lld",
+                 d_tuned_frequency, d_tuned_ns.load(std::memory_order_relaxed));
+        return line;
+    }
+    if (key == "scan_axis") {
+        char line[96];
+        snprintf(line, sizeof(line), "start_hz=%.3f bin_hz=%.3f bins=%zu",
+                 d_scan_start_rx, d_sample_rate / std::max<size_t>(d_psd_rx.size(), 1),
+                 d_psd_out_rx.size());
+        return line;
+    }
+    
+    const StreamStats &stats = key.compare(0, 3, "rx_") == 0 ? d_stats_rx : d_stats_tx;
+    
+    if (key == "rx_samples" or key == "tx_samples") {
+        return std::to_string(stats.samples.load(std::memory_order_relaxed));
+    }
+    if (key == "rx_overflows" or key == "tx_underflows") {
+        return std::to_string(stats.xruns.load(std::memory_order_relaxed));
+    }
+    if (key == "tx_inserted") {
+        return std::to_string(stats.inserted.load(std::memory_order_relaxed));
+    }
+    if (key == "rx_recover_failures" or key == "tx_recover_failures") {
+        return std::to_string(stats.recover_failures.load(std::memory_order_relaxed));
+    }
+    if (key == "rx_fill" or key == "tx_fill") {
+        return std::to_string(stats.fill.load(std::memory_order_relaxed));
+    }
+    if (key == "rx_wait" or key == "tx_wait") {
+        return stats.wait.toString();
+    }
+    if (key == "rx_transfer" or key == "tx_transfer") {
+        return stats.transfer.toString();
+    }
+    if (key == "rx_convert" or key == "tx_convert") {
+        return stats.convert.toString();
+    }
+    throw std::runtime_error("readSensor unknown key " + key);
+}
+
+
+// DC offset and IQ balance are corrected in the RX stream, see IqCorrector.
+// Offsets are in full scale units, the balance is the image coefficient,
+// 0 is off. Automatic mode tracks them and the getters return the estimate.
+bool SoapyTujaSDR::hasDCOffsetMode(const int direction, const size_t channel) const
+{
+    return direction == SOAPY_SDR_RX;
+}
+
+void SoapyTujaSDR::setDCOffsetMode(const int direction, const size_t channel, const bool automatic)
+{
+    if (direction == SOAPY_SDR_RX) {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        d_dc_offset_auto_rx = automatic;
+        d_ddc_changed_rx = true;
+    }
+}
+
+bool SoapyTujaSDR::getDCOffsetMode(const int direction, const size_t channel) const
+{
+    std::lock_guard<std::mutex> lock(d_ddc_mutex);
+    return direction == SOAPY_SDR_RX and d_dc_offset_auto_rx;
+}
+
+bool SoapyTujaSDR::hasDCOffset(const int direction, const size_t channel) const
+{
+    return direction == SOAPY_SDR_RX;
+}
+
+void SoapyTujaSDR::setDCOffset(const int direction, const size_t channel, const std::complex<double> &offset)
+{
+    if (direction == SOAPY_SDR_RX) {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        d_dc_offset_rx = offset;
+        d_ddc_changed_rx = true;
+    }
+}
+
+std::complex<double> SoapyTujaSDR::getDCOffset(const int direction, const size_t channel) const
+{
+    std::lock_guard<std::mutex> lock(d_ddc_mutex);
+    return direction == SOAPY_SDR_RX ? d_dc_offset_rx : 0.0;
+}
+
+bool SoapyTujaSDR::hasIQBalance(const int direction, const size_t channel) const
+{
+    return direction == SOAPY_SDR_RX;
+}
 
 void SoapyTujaSDR::setIQBalance (const int direction, const size_t channel, const std::complex< double > &balance) {
-    // TODO
+    if (direction == SOAPY_SDR_RX) {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        d_iq_balance_rx = balance;
+        d_ddc_changed_rx = true;
+    }
 }
 
 std::complex<double> SoapyTujaSDR::getIQBalance (const int direction, const size_t channel) const {
-    return std::complex<double>(1,1);
+    std::lock_guard<std::mutex> lock(d_ddc_mutex);
+    return direction == SOAPY_SDR_RX ? d_iq_balance_rx : 0.0;
 }
 
-/*
- TODO:
- bool SoapyTujaSDR::hasDCOffsetMode(const int direction, const size_t channel) const
- {
- return false;
- }*/
-
+// One RX gain element, DIGITAL, applied by the format converters. It
+// lifts weak signals above the quantization of the narrower formats, the
+// CS32 capture has the bits to spare. Automatic mode is the AGC, see Agc,
+// and getGain returns where it is.
 std::vector<std::string> SoapyTujaSDR::listGains(const int direction, const size_t channel) const
 {
-    //list available gain elements,
-    //the functions below have a "name" parameter
     std::vector<std::string> gains;
-    // gains.push_back("AUDIO");
+    if (direction == SOAPY_SDR_RX) {
+        gains.push_back("DIGITAL");
+    }
     return gains;
 }
 
 bool SoapyTujaSDR::hasGainMode(const int direction, const size_t channel) const
 {
-    SoapySDR_log(SOAPY_SDR_DEBUG, "hasGainMode");
-    return false;
+    return direction == SOAPY_SDR_RX;
 }
 
 void SoapyTujaSDR::setGainMode(const int direction, const size_t channel, const bool automatic)
 {
-    SoapySDR_log(SOAPY_SDR_DEBUG, "setGainMode");
-    // SoapySDR::Device::setGainMode(direction, channel, automatic);
+    if (direction == SOAPY_SDR_RX) {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        d_gain_auto_rx = automatic;
+        d_ddc_changed_rx = true;
+    }
 }
 
 bool SoapyTujaSDR::getGainMode(const int direction, const size_t channel) const
 {
-    SoapySDR_log(SOAPY_SDR_DEBUG, "getGainMode");
-    return false;
+    std::lock_guard<std::mutex> lock(d_ddc_mutex);
+    return direction == SOAPY_SDR_RX and d_gain_auto_rx;
 }
 
 void SoapyTujaSDR::setGain(const int direction, const size_t channel, const double value)
 {
-    SoapySDR_log(SOAPY_SDR_DEBUG, "setGain");
-    // SoapySDR::Device::setGain(direction, channel, value);
+    if (direction == SOAPY_SDR_RX) {
+        setGain(direction, channel, "DIGITAL", value);
+    }
 }
 
 void SoapyTujaSDR::setGain(const int direction, const size_t channel, const std::string &name, const double value)
 {
-    SoapySDR_logf(SOAPY_SDR_DEBUG, "Setting gain: %f", value);
+    if (direction != SOAPY_SDR_RX or name != "DIGITAL") {
+        throw std::runtime_error("setGain unknown gain " + name);
+    }
+    // When automatic this is where the AGC carries on from
+    std::lock_guard<std::mutex> lock(d_ddc_mutex);
+    d_gain_rx = std::min(std::max(value, Agc::minGain), Agc::maxGain);
+    d_ddc_changed_rx = true;
 }
 
 double SoapyTujaSDR::getGain(const int direction, const size_t channel, const std::string &name) const
 {
-    SoapySDR_log(SOAPY_SDR_DEBUG, "getGain");
-    return 0;
+    if (direction != SOAPY_SDR_RX or name != "DIGITAL") {
+        throw std::runtime_error("getGain unknown gain " + name);
+    }
+    std::lock_guard<std::mutex> lock(d_ddc_mutex);
+    return d_gain_rx;
 }
 
 SoapySDR::Range SoapyTujaSDR::getGainRange(const int direction, const size_t channel, const std::string &name) const
 {
-    SoapySDR_log(SOAPY_SDR_DEBUG, "getGainRange");
-    return SoapySDR::Range(0, 100);
+    if (direction != SOAPY_SDR_RX or name != "DIGITAL") {
+        throw std::runtime_error("getGainRange unknown gain " + name);
+    }
+    return SoapySDR::Range(Agc::minGain, Agc::maxGain);
 }
 
 // Frequency
+void SoapyTujaSDR::setFrequency(const int direction,
+                                const size_t channel,
+                                const double frequency,
+                                const SoapySDR::Kwargs &args)
+{
+    SoapySDR_log(SOAPY_SDR_DEBUG, "setFrequency");
+    
+    // Virtual channels share the RF LO. Tuning one to somewhere it still
+    // fits inside the capture only moves its own BB, so the others stay put.
+    if (direction == SOAPY_SDR_RX and d_num_channels_rx > 1 and args.count("OFFSET") == 0) {
+        const double bb = frequency - centerFrequency();
+        if (std::abs(bb) <= (d_sample_rate - getSampleRate(direction, channel)) / 2) {
+            setFrequency(direction, channel, "BB", bb, args);
+            return;
+        }
+    }
+    SoapySDR::Device::setFrequency(direction, channel, frequency, args);
+}
+
 void SoapyTujaSDR::setFrequency(const int direction,
                                 const size_t channel,
                                 const std::string &name,
@@ -557,17 +2886,87 @@ void SoapyTujaSDR::setFrequency(const int direction,
 {
     SoapySDR_log(SOAPY_SDR_DEBUG, "setFrequency");
     
-    if (name == "RF" && d_center_frequency != frequency)
+    if (name == "RF" && d_replay)
+    {
+        // Stays where it was recorded, the rest of a tune goes to BB
+        SoapySDR_log(SOAPY_SDR_DEBUG, "setFrequency: a replay can't retune RF");
+    }
+    else if (name == "RF")
     {
-        tuja_set_frequency(d_tuja, frequency);
-        d_center_frequency = frequency;
+        // Returns straight away, tuneWorker talks to the hardware
+        std::lock_guard<std::mutex> lock(d_tune_mutex);
+        if (d_center_frequency != frequency) {
+            d_tune_frequency = frequency;
+            d_tune_pending = true;
+            d_center_frequency = frequency;
+            d_tune_cond.notify_one();
+        }
+    }
+    else if (name == "BB" && direction == SOAPY_SDR_RX)
+    {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        d_bb_frequency_rx.at(channel) = std::max(-d_sample_rate / 2, std::min(d_sample_rate / 2, frequency));
+        d_ddc_changed_rx = true;
+    }
+    else if (name == "BB" && direction == SOAPY_SDR_TX)
+    {
+        std::lock_guard<std::mutex> lock(d_duc_mutex);
+        d_bb_frequency_tx = std::max(-d_sample_rate / 2, std::min(d_sample_rate / 2, frequency));
+        d_duc_changed_tx = true;
+    }
+}
+
+// Where setFrequency last put the RF LO, the hardware may still be on
+// its way there
+double SoapyTujaSDR::centerFrequency() const
+{
+    std::lock_guard<std::mutex> lock(d_tune_mutex);
+    return d_center_frequency;
+}
+
+// Applies the latest RF frequency asked for, requests that come in while
+// the hardware is busy replace each other
+void SoapyTujaSDR::tuneWorker()
+{
+    std::unique_lock<std::mutex> lock(d_tune_mutex);
+    while (true) {
+        d_tune_cond.wait(lock, [this] { return d_tune_stop or d_tune_pending; });
+        if (d_tune_stop) {
+            return;
+        }
+        const double frequency = d_tune_frequency;
+        d_tune_pending = false;
+        
+        lock.unlock();
+        int err;
+        {
+            std::lock_guard<std::mutex> tuja_lock(d_tuja_mutex);
+            err = tuja_set_frequency(d_tuja, (uint32_t) frequency);
+        }
+        const long long timeNs = getHardwareTime();
+        lock.lock();
+        
+        if (err < 0) {
+            SoapySDR_logf(SOAPY_SDR_ERROR, "tuja_set_frequency: %s", strerror(-err));
+            continue;
+        }
+        d_tuned_frequency = frequency;
+        d_tuned_ns.store(timeNs, std::memory_order_relaxed);
     }
 }
 
 double SoapyTujaSDR::getFrequency(const int direction, const size_t channel, const std::string &name) const
 {
     SoapySDR_logf(SOAPY_SDR_DEBUG, "getFrequency");
-    return d_center_frequency;
+    if (name == "BB" and direction == SOAPY_SDR_RX) {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        return d_bb_frequency_rx.at(channel);
+    }
+    if (name == "BB" and direction == SOAPY_SDR_TX) {
+        std::lock_guard<std::mutex> lock(d_duc_mutex);
+        return d_bb_frequency_tx;
+    }
+    return centerFrequency();
 }
 
 std::vector<std::string> SoapyTujaSDR::listFrequencies(const int direction, const size_t channel) const
@@ -576,6 +2975,8 @@ std::vector<std::string> SoapyTujaSDR::listFrequencies(const int direction, cons
     
     std::vector<std::string> names;
     names.push_back("RF");
+    // DDC/DUC fine tuning, the NCO moves RF + BB to or from DC
+    names.push_back("BB");
     return names;
 }
 
@@ -584,11 +2985,20 @@ SoapySDR::RangeList SoapyTujaSDR::getFrequencyRange(const int direction, const s
     SoapySDR_log(SOAPY_SDR_DEBUG, "getFrequencyRange");
     
     SoapySDR::RangeList results;
-    if (name == "RF")
+    if (name == "RF" && d_replay)
+    {
+        // Where it was recorded
+        results.push_back(SoapySDR::Range(d_replay->frequency(), d_replay->frequency()));
+    }
+    else if (name == "RF")
     {
         // There's a filter bank switch at 15MHz so do this for now
         results.push_back(SoapySDR::Range(0, 45000000));
     }
+    else if (name == "BB")
+    {
+        results.push_back(SoapySDR::Range(-d_sample_rate / 2, d_sample_rate / 2));
+    }
     return results;
 }
 
@@ -600,22 +3010,55 @@ SoapySDR::ArgInfoList SoapyTujaSDR::getFrequencyArgsInfo(const int direction, co
     return freqArgs;
 }
 
+// Rates are the hardware rate divided down by the DDC (RX) or multiplied
+// up to it by the DUC (TX)
+static const size_t rateFactors[] = {1, 2, 4, 8, 11};
+
 void SoapyTujaSDR::setSampleRate(const int direction, const size_t channel, const double rate)
 {
     SoapySDR_log(SOAPY_SDR_DEBUG, "setSampleRate");
+    
+    // Closest rate we have
+    size_t factor = 1;
+    for (const size_t f : rateFactors) {
+        if (std::abs(d_sample_rate / f - rate) < std::abs(d_sample_rate / factor - rate)) {
+            factor = f;
+        }
+    }
+    if (std::abs(d_sample_rate / factor - rate) > 1.0) {
+        SoapySDR_logf(SOAPY_SDR_INFO, "setSampleRate %f not supported, using %f",
+                      rate, d_sample_rate / factor);
+    }
+    
+    if (direction == SOAPY_SDR_RX) {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        d_decimation_rx = factor;
+        d_ddc_changed_rx = true;
+    } else {
+        std::lock_guard<std::mutex> lock(d_duc_mutex);
+        d_interpolation_tx = factor;
+        d_duc_changed_tx = true;
+    }
 }
 
 double SoapyTujaSDR::getSampleRate(const int direction, const size_t channel) const
 {
     SoapySDR_logf(SOAPY_SDR_DEBUG, "getSampleRate %f", d_sample_rate);
-    return d_sample_rate;
+    if (direction == SOAPY_SDR_RX) {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        return d_sample_rate / d_decimation_rx;
+    }
+    std::lock_guard<std::mutex> lock(d_duc_mutex);
+    return d_sample_rate / d_interpolation_tx;
 }
 
 std::vector<double> SoapyTujaSDR::listSampleRates(const int direction, const size_t channel) const
 {
     SoapySDR_log(SOAPY_SDR_DEBUG, "listSampleRates");
     std::vector<double> rates;
-    rates.push_back(d_sample_rate);
+    for (const size_t f : rateFactors) {
+        rates.push_back(d_sample_rate / f);
+    }
     return rates;
 }
 
@@ -628,7 +3071,7 @@ void SoapyTujaSDR::setBandwidth(const int direction, const size_t channel, const
 double SoapyTujaSDR::getBandwidth(const int direction, const size_t channel) const
 {
     SoapySDR_log(SOAPY_SDR_DEBUG, "getBandwidth");
-    return d_sample_rate;
+    return getSampleRate(direction, channel);
 }
 
 SoapySDR::ArgInfoList SoapyTujaSDR::getSettingInfo(void) const
@@ -637,18 +3080,116 @@ SoapySDR::ArgInfoList SoapyTujaSDR::getSettingInfo(void) const
     
     SoapySDR_log(SOAPY_SDR_DEBUG, "getSettingInfo");
     
+    SoapySDR::ArgInfo calibrateArg;
+    calibrateArg.key = "calibrate";
+    calibrateArg.value = "false";
+    calibrateArg.name = "Calibrate latency";
+    calibrateArg.description = "Write true to measure the RX/TX round trip with TX looped back to RX. "
+    "Both streams must be set up and inactive.";
+    calibrateArg.type = SoapySDR::ArgInfo::BOOL;
+    settings.push_back(calibrateArg);
+    
+    SoapySDR::ArgInfo latencyArg;
+    latencyArg.key = "latency";
+    latencyArg.value = "-1";
+    latencyArg.name = "Round trip latency";
+    latencyArg.description = "From playback position to capture index, measured by calibrate. "
+    "-1 until calibrated or if the probe was not found.";
+    latencyArg.units = "samples";
+    latencyArg.type = SoapySDR::ArgInfo::INT;
+    settings.push_back(latencyArg);
+    
+    // SoapySDR 0.7 has no IQ balance mode
+    SoapySDR::ArgInfo iqArg;
+    iqArg.key = "iq_balance_auto";
+    iqArg.value = "false";
+    iqArg.name = "Automatic IQ balance";
+    iqArg.description = "Track the RX IQ imbalance, getIQBalance returns the estimate.";
+    iqArg.type = SoapySDR::ArgInfo::BOOL;
+    settings.push_back(iqArg);
+    
+    SoapySDR::ArgInfo recordArg;
+    recordArg.key = "record";
+    recordArg.value = "";
+    recordArg.name = "Record";
+    recordArg.description = "Write a path to record the RX capture to path.sigmf-data and "
+    "path.sigmf-meta at the hardware rate, an empty string stops. Samples are "
+    "recorded while the RX stream runs.";
+    recordArg.type = SoapySDR::ArgInfo::STRING;
+    settings.push_back(recordArg);
+    
+    SoapySDR::ArgInfo recordFormatArg;
+    recordFormatArg.key = "record_format";
+    recordFormatArg.value = "CS32";
+    recordFormatArg.name = "Record format";
+    recordFormatArg.description = "Sample format of the next recording.";
+    recordFormatArg.type = SoapySDR::ArgInfo::STRING;
+    recordFormatArg.options = {"CS32", "CS16", "CS8", "CU8", "CF32", "CF64"};
+    settings.push_back(recordFormatArg);
+    
+    SoapySDR::ArgInfo recordDroppedArg;
+    recordDroppedArg.key = "record_dropped";
+    recordDroppedArg.value = "0";
+    recordDroppedArg.name = "Record dropped";
+    recordDroppedArg.description = "Samples left out of the recording because the disk fell behind.";
+    recordDroppedArg.units = "samples";
+    recordDroppedArg.type = SoapySDR::ArgInfo::INT;
+    settings.push_back(recordDroppedArg);
+    
     return settings;
 }
 
 void SoapyTujaSDR::writeSetting(const std::string &key, const std::string &value)
 {
     SoapySDR_log(SOAPY_SDR_DEBUG, "writeSetting");
+    
+    if (key == "calibrate" and value == "true") {
+        calibrateLatency();
+    }
+    if (key == "iq_balance_auto") {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        d_iq_balance_auto_rx = value == "true";
+        d_ddc_changed_rx = true;
+    }
+    if (key == "record_format") {
+        std::lock_guard<std::mutex> lock(d_record_mutex);
+        d_record_format = value;
+    }
+    if (key == "record") {
+        if (value.empty() or value == "false") {
+            d_recorder_rx.stop();
+        } else {
+            std::lock_guard<std::mutex> lock(d_record_mutex);
+            d_recorder_rx.start(value, d_record_format, d_sample_rate, (size_t) d_channels,
+                                centerFrequency());
+        }
+    }
 }
 
 std::string SoapyTujaSDR::readSetting(const std::string &key) const
 {
     SoapySDR_log(SOAPY_SDR_DEBUG, "readSetting");
     
+    if (key == "latency") {
+        return std::to_string(d_latency);
+    }
+    if (key == "calibrate") {
+        return "false";
+    }
+    if (key == "iq_balance_auto") {
+        std::lock_guard<std::mutex> lock(d_ddc_mutex);
+        return d_iq_balance_auto_rx ? "true" : "false";
+    }
+    if (key == "record") {
+        return d_recorder_rx.path();
+    }
+    if (key == "record_format") {
+        std::lock_guard<std::mutex> lock(d_record_mutex);
+        return d_record_format;
+    }
+    if (key == "record_dropped") {
+        return std::to_string(d_recorder_rx.dropped());
+    }
     return "empty";
 }
 
@@ -656,7 +3197,7 @@ std::vector<double> SoapyTujaSDR::listBandwidths(const int direction, const size
 {
     SoapySDR_log(SOAPY_SDR_DEBUG, "listBandwidths");
     std::vector<double> results;
-    results.push_back(d_sample_rate);
+    results.push_back(getSampleRate(direction, channel));
     return results;
 }
 
@@ -670,8 +3211,17 @@ SoapySDR::KwargsList findTujaSDR(const SoapySDR::Kwargs &args)
     SoapySDR::Kwargs soapyInfo;
     
     // soapyInfo["device_id"] = std::to_string(0);
+    if (args.count("file")) {
+        // A recording played back, see Replay
+        soapyInfo["device"] = "TujaSDR replay";
+        soapyInfo["file"] = args.at("file");
+        results.push_back(soapyInfo);
+        return results;
+    }
     soapyInfo["device"] = "TujaSDR"; // This is usually what is diplayed
-    soapyInfo["alsadevice"] = "hw:CARD=tujasdr,DEV=0";
+    // Allow a stand-in, like null or snd-aloop, for testing without hardware
+    soapyInfo["alsadevice"] = args.count("alsadevice") ?
+    args.at("alsadevice") : "hw:CARD=tujasdr,DEV=0";
     
     results.push_back(soapyInfo);
     
@@ -685,16 +3235,42 @@ SoapySDR::Device *makeTujaSDR(const SoapySDR::Kwargs &args)
     //create an instance of the device object given the args
     //here we will translate args into something used in the constructor
     
-    std::string alsa_device = args.at("alsadevice");
-    return (SoapySDR::Device*) new SoapyTujaSDR(alsa_device);
+    std::string alsa_device = args.count("alsadevice") ? args.at("alsadevice") : "";
+    std::string i2c_device = args.count("i2c") ? args.at("i2c") : "/dev/i2c-1";
+    int i2c_address = args.count("i2c_addr") ? std::stoi(args.at("i2c_addr"), nullptr, 0) : 0x23;
+    
+    // Scheduling of the streaming I/O, see realtime.h
+    rt_config_t rt_config;
+    rt_config.priority = args.count("rt_priority") ? std::stoi(args.at("rt_priority")) : 0;
+    if (rt_config.priority < 0 or rt_config.priority > sched_get_priority_max(SCHED_FIFO)) {
+        throw std::runtime_error("makeTujaSDR invalid rt_priority " + args.at("rt_priority"));
+    }
+    CPU_ZERO(&rt_config.cpus);
+    if (args.count("cpu_affinity") and
+        rt_parse_cpus(args.at("cpu_affinity").c_str(), &rt_config.cpus) < 0) {
+        throw std::runtime_error("makeTujaSDR invalid cpu_affinity " + args.at("cpu_affinity"));
+    }
+    rt_config.lock_memory = args.count("mlock") and args.at("mlock") == "true";
+    
+    // Virtual RX channels, see Channelizer
+    const int rx_channels = args.count("rx_channels") ? std::stoi(args.at("rx_channels")) : 1;
+    if (rx_channels < 1) {
+        throw std::runtime_error("makeTujaSDR invalid rx_channels " + args.at("rx_channels"));
+    }
+    
+    // Paced like the hardware or as fast as the client reads
+    Replay *replay = nullptr;
+    if (args.count("file")) {
+        const std::string pace = args.count("pace") ? args.at("pace") : "realtime";
+        if (pace != "realtime" and pace != "fast") {
+            throw std::runtime_error("makeTujaSDR invalid pace " + pace);
+        }
+        replay = new Replay(args.at("file"), pace == "fast", args.count("loop") and args.at("loop") == "true");
+    }
+    
+    return (SoapySDR::Device*) new SoapyTujaSDR(alsa_device, i2c_device, i2c_address, rt_config,
+                                                (size_t) rx_channels, replay);
 }
 
-// Register format converters
-static SoapySDR::ConverterRegistry registerVolkCS32toCF32(SOAPY_SDR_CS32, SOAPY_SDR_CF32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS32toCF32);
-
-static SoapySDR::ConverterRegistry registerVolkCF32toCS32(SOAPY_SDR_CF32, SOAPY_SDR_CS32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCF32toCS32);
-
-static SoapySDR::ConverterRegistry registerVolkCS32toCS16(SOAPY_SDR_CS32, SOAPY_SDR_CS16, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS32toCS16);
-
 // Register driver
 static SoapySDR::Registry registerTujaSDR("tujasdr", &findTujaSDR, &makeTujaSDR, SOAPY_SDR_ABI_VERSION);
@@ -14,37 +14,275 @@
 #include <cstdint>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <tuja.h>
 
 #include "alsa.h"
+#include "dsp.hpp"
+#include "realtime.h"
+#include "recorder.hpp"
+#include "replay.hpp"
+#include "ringbuffer.hpp"
+#include "streamstats.hpp"
+#include "volkbuffer.hpp"
 
 /*
  soapy=0,remote=sdr.local,remote:format=CS16
  */
 
+// Ties a sample index to CLOCK_MONOTONIC time
+struct TimeAnchor
+{
+    uint64_t index;
+    long long timeNs;
+};
+
 class SoapyTujaSDR : public SoapySDR::Device
 {
 private: 
     snd_pcm_t* d_pcm_capture_handle;
     snd_pcm_t* d_pcm_playback_handle;
-    const unsigned int d_periods;
-    const unsigned int d_period_frames;
+    // Per direction buffer geometry, see alsa_config_profile
+    alsa_config_t d_config_rx;
+    alsa_config_t d_config_tx;
     const double d_channels;
     const double d_sample_rate;
     
-    double d_center_frequency;
+    double d_center_frequency; // under d_tune_mutex, see centerFrequency
     const std::string d_alsa_device;
-    std::vector<int32_t> d_buff_rx;
-    std::vector<int32_t> d_buff_tx;
+    VolkBuffer<int32_t> d_buff_rx;
+    VolkBuffer<int32_t> d_buff_tx;
+    
+    // Client asked for CS32, ALSA reads and writes the client buffer
+    bool d_native_rx;
+    bool d_native_tx;
+    
+    // mmap access, lets CS32 clients use the direct buffer API
+    bool d_mmap_rx;
+    bool d_mmap_tx;
+    bool d_direct_rx;
+    bool d_direct_tx;
+    snd_pcm_uframes_t d_mmap_offset_rx;
+    snd_pcm_uframes_t d_mmap_frames_rx;
+    snd_pcm_uframes_t d_mmap_offset_tx;
+    snd_pcm_uframes_t d_mmap_frames_tx;
+    
+    // Optional I/O thread moving samples between ALSA and lock-free rings
+    // so readStream and writeStream never make a syscall. One thread polls
+    // both PCMs, opened non blocking, and services RX and TX in the same
+    // wakeup.
+    bool d_threaded_rx;
+    bool d_threaded_tx;
+    std::unique_ptr<RingBuffer> d_ring_rx;
+    std::unique_ptr<RingBuffer> d_ring_tx;
+    std::thread d_engine_thread;
+    std::atomic<bool> d_engine_running;
+    std::atomic<bool> d_engine_rx;      // directions the engine services
+    std::atomic<bool> d_engine_tx;
+    std::atomic<bool> d_engine_idle_tx; // TX ring ran dry, writer must wake us
+    int d_engine_event;                 // eventfd to wake up poll()
+    std::mutex d_engine_mutex;          // RX and TX may be (de)activated from different threads
+    std::atomic<bool> d_overflow_rx;
+    std::atomic<bool> d_underflow_tx;
+    std::mutex d_ring_mutex_rx;
+    std::condition_variable d_ring_cond_rx;
+    std::mutex d_ring_mutex_tx;
+    std::condition_variable d_ring_cond_tx;
+    
+    alsa_config_t streamConfig(const SoapySDR::Kwargs &args) const;
+    
+    void engineLoop();
+    void startEngine();
+    void stopEngine();
+    void wakeEngine();
+    void setEngine(const int direction, const bool enable);
+    void serviceCapture();
+    void servicePlayback();
+    int waitCapture(const long timeoutUs, const size_t minFrames = 1);
+    int waitPlayback(const long timeoutUs, const size_t minFrames = 1);
+    void commitPlayback(const size_t numElems);
+    
+    // Capture and playback linked with snd_pcm_link start, stop and
+    // prepare together, so capture index n and playback position n are
+    // the same instant. Linked playback is free running, an underrun
+    // would otherwise stop capture too.
+    bool d_link_tx;         // TX stream asked for link=true
+    bool d_fill_tx;         // underrun=fill, free running instead of XRUN
+    snd_pcm_uframes_t d_prefill_tx; // silence queued at start and after underruns
+    bool d_linked;
+    bool d_active_rx;
+    bool d_active_tx;
+    long d_latency;         // round trip, samples, -1 until calibrated
+    
+    void linkStreams();
+    void unlinkStreams();
+    snd_pcm_sframes_t catchUpPlayback(const snd_pcm_sframes_t avail);
+    int prefillPlayback();
+    long calibrateLatency();
+    
+    // RX timestamps. Sample index counts frames since setupStream and is
+    // re-anchored to snd_pcm_htimestamp after start and every overflow.
+    uint64_t d_sample_index_rx;
+    TimeAnchor d_anchor_rx;
+    bool d_anchored_rx;
+    bool d_need_anchor_rx;
+    // Anchors from the I/O thread, in ring index space
+    TimeAnchor d_engine_anchor_rx;
+    bool d_engine_anchored_rx;
+    bool d_engine_need_anchor_rx;
+    std::deque<TimeAnchor> d_anchor_queue_rx;
+    std::deque<TimeAnchor> d_anchors_rx;
+    std::atomic<bool> d_anchor_pending_rx;
+    std::mutex d_anchor_mutex_rx;
+    
+    bool anchorCapture(const uint64_t index, TimeAnchor &anchor, const bool clamp);
+    size_t timeCapture(const uint64_t index, const size_t numElems, int &flags, long long &timeNs);
+    
+    // Scheduling and memory locking for the streaming I/O, from device args.
+    // The thread ids remember which caller threads have been configured.
+    const rt_config_t d_rt_config;
+    std::thread::id d_rt_thread_rx;
+    std::thread::id d_rt_thread_tx;
+    
+    void realtimeThread(std::thread::id &configured);
+    void lockBuffers(const int direction);
+    void unlockBuffers(const int direction);
+    
+    // RX digital downconverters, one per virtual channel in the stream, run
+    // on the reading thread. Settings are written under d_ddc_mutex and
+    // picked up by applyDdc before the next block, so they can change from
+    // any thread while streaming. The decimation is shared by all channels,
+    // the BB frequency is per virtual channel.
+    const size_t d_num_channels_rx;
+    std::vector<size_t> d_stream_channels_rx;
+    Channelizer d_ddc_rx;
+    VolkBuffer<int32_t> d_ddc_buff_rx;
+    std::vector<int32_t *> d_ddc_outs_rx;
+    size_t d_decimation_rx;
+    std::vector<double> d_bb_frequency_rx;
+    // Front end correction, with the estimates copied back when automatic
+    bool d_dc_offset_auto_rx;
+    std::complex<double> d_dc_offset_rx;
+    bool d_iq_balance_auto_rx;
+    std::complex<double> d_iq_balance_rx;
+    // Digital gain in the converters, same arrangement
+    bool d_gain_auto_rx;
+    double d_gain_rx;
+    Agc d_agc_rx;
+    // Block floating point, a power of two on top of the gain per block
+    bool d_bfp_rx;
+    std::atomic<bool> d_ddc_changed_rx;
+    mutable std::mutex d_ddc_mutex;
+    
+    void applyDdc();
+    size_t convertCapture(const void *capture, const size_t numFrames, void * const *outs,
+                          long long &offset, int &flags);
+    
+    // TX digital upconverter, the same on the writing thread
+    Duc d_duc_tx;
+    VolkBuffer<int32_t> d_duc_buff_tx;
+    size_t d_interpolation_tx;
+    double d_bb_frequency_tx;
+    std::atomic<bool> d_duc_changed_tx;
+    mutable std::mutex d_duc_mutex;
+    
+    void applyDuc();
+    size_t convertPlayback(const void *buff, const size_t numElems, int32_t *out);
+    
+    // FFT modes, streams of power spectra instead of samples. Scan mode
+    // retunes through a sweep, waits out the settle window after each
+    // retune and keeps the middle bins of one FFT per step. Spectrum mode
+    // averages overlapping FFTs of the stream into frames at frame rate.
+    // Either way the output is assembled in d_psd_out_rx across calls and
+    // then handed out in fragments.
+    bool d_scan_rx;
+    bool d_spectrum_rx;
+    Spectrum d_psd_rx;
+    VolkBuffer<int32_t> d_fft_buff_rx;
+    size_t d_fft_frames_rx;
+    long long d_fft_time_rx;        // of the first frame, -1 without timestamps
+    VolkBuffer<float> d_psd_out_rx;
+    bool d_psd_ready_rx;
+    size_t d_psd_offset_rx;
+    long long d_psd_time_rx;
+    
+    double d_scan_start_rx;
+    size_t d_scan_steps_rx;
+    size_t d_scan_bins_rx;          // per step
+    size_t d_scan_settle_rx;        // frames
+    VolkBuffer<float> d_scan_power_rx;
+    size_t d_scan_step_rx;
+    bool d_scan_tuned_rx;
+    long long d_scan_ready_rx;      // first settled sample time
+    size_t d_scan_skip_rx;          // same, in frames without timestamps
+    
+    size_t d_spectrum_hop_rx;       // frames between FFTs
+    double d_spectrum_rate_rx;      // frames out per second
+    
+    void setupFft(const SoapySDR::Kwargs &args);
+    void setupScan(const SoapySDR::Kwargs &args);
+    void setupSpectrum(const SoapySDR::Kwargs &args);
+    double scanFrequency(const size_t step) const;
+    int readScan(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+    int readSpectrum(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+    int readPsd(void * const *buffs, const size_t numElems, int &flags, long long &timeNs);
+    int readCapture(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+    
+    // Health counters, read through the sensor API
+    StreamStats d_stats_rx;
+    StreamStats d_stats_tx;
+    
+    // Everything captured goes to disk too while recording, from
+    // whichever thread reads ALSA
+    Recorder d_recorder_rx;
+    mutable std::mutex d_record_mutex;
+    std::string d_record_format;
     
     // libtuja hardware control
     tuja_t *d_tuja;
     
+    // Or a recording played back in place of the hardware, RX only,
+    // converted to CS32 if it isn't
+    std::unique_ptr<Replay> d_replay;
+    SoapySDR::ConverterRegistry::ConverterFunction d_replay_converter;
+    int readReplay(void * const *buffs, const size_t numElems, int &flags, long long &timeNs, const long timeoutUs);
+    
+    // RF tuning runs on d_tune_thread so a slow I2C transfer never stalls
+    // the caller, often the thread that streams. Requests coalesce, only
+    // the latest is applied. d_tuned_ns is when the last one took effect
+    // on the same clock as the RX timestamps, the first RX block to reach
+    // it carries SOAPY_SDR_USER_FLAG0. Scans tune directly, d_tuja_mutex
+    // keeps them apart.
+    std::thread d_tune_thread;
+    std::mutex d_tuja_mutex;
+    mutable std::mutex d_tune_mutex;
+    std::condition_variable d_tune_cond;
+    bool d_tune_stop;
+    bool d_tune_pending;
+    double d_tune_frequency;
+    double d_tuned_frequency;
+    std::atomic<long long> d_tuned_ns;
+    long long d_retune_reported_rx;
+    
+    void tuneWorker();
+    double centerFrequency() const;
+    void retunedCapture(const long long timeNs, const size_t numFrames, int &flags);
+    
     SoapySDR::ConverterRegistry::ConverterFunction d_converter_func_rx;
     SoapySDR::ConverterRegistry::ConverterFunction d_converter_func_tx;
     
 public:
-    SoapyTujaSDR(const std::string &alsa_device);
+    SoapyTujaSDR(const std::string &alsa_device,
+                 const std::string &i2c_device,
+                 const int i2c_address,
+                 const rt_config_t &rt_config,
+                 const size_t rx_channels,
+                 Replay *replay);
     ~SoapyTujaSDR();
     
     //Implement all applicable virtual methods from SoapySDR::Device
@@ -86,23 +324,49 @@ public:
                      const long long timeNs=0,
                      const long timeoutUs=100000);
     
+    // Direct buffer access API
+    size_t getNumDirectAccessBuffers(SoapySDR::Stream *stream);
+    int acquireReadBuffer(SoapySDR::Stream *stream,
+                          size_t &handle,
+                          const void **buffs,
+                          int &flags,
+                          long long &timeNs,
+                          const long timeoutUs = 100000);
+    void releaseReadBuffer(SoapySDR::Stream *stream, const size_t handle);
+    int acquireWriteBuffer(SoapySDR::Stream *stream,
+                           size_t &handle,
+                           void **buffs,
+                           const long timeoutUs = 100000);
+    void releaseWriteBuffer(SoapySDR::Stream *stream,
+                            const size_t handle,
+                            const size_t numElems,
+                            int &flags,
+                            const long long timeNs = 0);
+    
     // Antennas
     std::vector<std::string> listAntennas(const int direction, const size_t channel) const;
     void setAntenna(const int direction, const size_t channel, const std::string &name);
     std::string getAntenna(const int direction, const size_t channel) const;
     
-    // Time TODO
+    // Time
     bool hasHardwareTime (const std::string &what="") const;
     long long getHardwareTime (const std::string &what="") const;
     
-    // Sensors TODO
+    // Sensors
     std::vector<std::string> listSensors (void) const;
+    SoapySDR::ArgInfo getSensorInfo (const std::string &key) const;
+    std::string readSensor (const std::string &key) const;
     
     // DC offset
-    //bool hasDCOffsetMode(const int direction, const size_t channel) const;
+    bool hasDCOffsetMode(const int direction, const size_t channel) const;
+    void setDCOffsetMode(const int direction, const size_t channel, const bool automatic);
+    bool getDCOffsetMode(const int direction, const size_t channel) const;
+    bool hasDCOffset(const int direction, const size_t channel) const;
+    void setDCOffset(const int direction, const size_t channel, const std::complex<double> &offset);
+    std::complex<double> getDCOffset(const int direction, const size_t channel) const;
     
     // IQ balance
-    // TODO:
+    bool hasIQBalance(const int direction, const size_t channel) const;
     void setIQBalance (const int direction, const size_t channel, const std::complex< double > &balance);
     std::complex< double > getIQBalance (const int direction, const size_t channel) const;
     
@@ -117,6 +381,10 @@ public:
     SoapySDR::Range getGainRange(const int direction, const size_t channel, const std::string &name) const;
     
     // Frequency
+    void setFrequency(const int direction,
+                      const size_t channel,
+                      const double frequency,
+                      const SoapySDR::Kwargs &args = SoapySDR::Kwargs());
     void setFrequency(const int direction,
                       const size_t channel,
                       const std::string &name,
@@ -25,11 +25,40 @@ const char* alsa_state_str(snd_pcm_state_t state) {
     return snd_pcm_state_str[state];
 }
 
+int alsa_config_profile(const char* name, alsa_config_t *config) {
+    
+    config->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+    config->mode = 0;
+    config->free_run = 0;
+    
+    if (strcmp(name, "default") == 0) {
+        /* ~46 ms buffer at 89286 Hz */
+        config->periods = 4;
+        config->period_frames = 1024;
+        config->avail_min = 256;
+    } else if (strcmp(name, "low_latency") == 0) {
+        /* ~6 ms buffer, for QSK/CW */
+        config->periods = 4;
+        config->period_frames = 128;
+        config->avail_min = 128;
+    } else if (strcmp(name, "throughput") == 0) {
+        /* ~370 ms buffer, one wakeup every ~46 ms */
+        config->periods = 8;
+        config->period_frames = 4096;
+        config->avail_min = 4096;
+    } else {
+        return -EINVAL;
+    }
+    
+    /* Start playback when buffer is full */
+    config->start_threshold = config->periods * config->period_frames;
+    return 0;
+}
+
 /* Try to get an ALSA capture handle */
 snd_pcm_t* alsa_pcm_handle(const char* pcm_name,
                            unsigned int rate,
-                           const unsigned int periods,
-                           snd_pcm_uframes_t frames,
+                           const alsa_config_t *config,
                            snd_pcm_stream_t stream) {
 
     const unsigned int channels = 2;
@@ -43,8 +72,8 @@ snd_pcm_t* alsa_pcm_handle(const char* pcm_name,
     snd_pcm_hw_params_alloca(&hwparams);
     snd_pcm_sw_params_alloca(&swparams);
     
-    /* Open normal blocking */
-    if ((err = snd_pcm_open(&pcm_handle, pcm_name, stream, 0)) < 0) {
+    /* Normally blocking, non blocking when driven by poll() */
+    if ((err = snd_pcm_open(&pcm_handle, pcm_name, stream, config->mode)) < 0) {
         fprintf(stderr, "snd_pcm_open: %s\n", snd_strerror(err));
         return NULL;
     }
@@ -56,7 +85,8 @@ snd_pcm_t* alsa_pcm_handle(const char* pcm_name,
     }
     
     /* Interleaved access. (IQ interleaved). */
-    if ((err = snd_pcm_hw_params_set_access(pcm_handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+    /* SND_PCM_ACCESS_MMAP_INTERLEAVED lets us read straight from the DMA ring. */
+    if ((err = snd_pcm_hw_params_set_access(pcm_handle, hwparams, config->access)) < 0) {
         fprintf(stderr, "snd_pcm_hw_params_set_access: %s\n", snd_strerror(err));
         return NULL;
     }
@@ -82,13 +112,13 @@ snd_pcm_t* alsa_pcm_handle(const char* pcm_name,
     
     /* Period size */
     int dir = 0;
-    if ((err = snd_pcm_hw_params_set_period_size(pcm_handle, hwparams, frames, dir)) < 0) {
+    if ((err = snd_pcm_hw_params_set_period_size(pcm_handle, hwparams, config->period_frames, dir)) < 0) {
         fprintf(stderr, "snd_pcm_hw_params_set_period_size: %s\n", snd_strerror(err));
         return NULL;
     }
     
     /* Set number of periods. Periods used to be called fragments. */
-    if ((err = snd_pcm_hw_params_set_periods(pcm_handle, hwparams, periods, 0)) < 0) {
+    if ((err = snd_pcm_hw_params_set_periods(pcm_handle, hwparams, config->periods, 0)) < 0) {
         fprintf(stderr, "snd_pcm_hw_params_set_periods: %s\n", snd_strerror(err));
         return NULL;
     }
@@ -107,21 +137,37 @@ snd_pcm_t* alsa_pcm_handle(const char* pcm_name,
         return NULL;
     }
     
-    // Start playback when buffer is full
-    if ((err = snd_pcm_sw_params_set_start_threshold(pcm_handle, swparams, periods * frames)) < 0) {
+    // Start playback when this much is queued
+    if ((err = snd_pcm_sw_params_set_start_threshold(pcm_handle, swparams, config->start_threshold)) < 0) {
         fprintf(stderr, "snd_pcm_sw_params_set_start_threshold: %s\n", snd_strerror(err));
         return NULL;
     }
     
-    /* // TODO: Should we set a stop threshold?
-     // err = snd_pcm_sw_params_set_stop_threshold(pcm_handle, swparams, 64);
-     if (err < 0) {
-     fprintf(stderr, "snd_pcm_sw_params_set_stop_threshold: %s\n", snd_strerror(err));
-     return NULL;
-     }*/
+    /* Free running playback never stops on underrun, ALSA fills what was
+     played with silence instead. Linked streams need this since an
+     underrun would stop capture too. */
+    if (config->free_run) {
+        snd_pcm_uframes_t boundary;
+        if ((err = snd_pcm_sw_params_get_boundary(swparams, &boundary)) < 0) {
+            fprintf(stderr, "snd_pcm_sw_params_get_boundary: %s\n", snd_strerror(err));
+            return NULL;
+        }
+        if ((err = snd_pcm_sw_params_set_stop_threshold(pcm_handle, swparams, boundary)) < 0) {
+            fprintf(stderr, "snd_pcm_sw_params_set_stop_threshold: %s\n", snd_strerror(err));
+            return NULL;
+        }
+        if ((err = snd_pcm_sw_params_set_silence_threshold(pcm_handle, swparams, 0)) < 0) {
+            fprintf(stderr, "snd_pcm_sw_params_set_silence_threshold: %s\n", snd_strerror(err));
+            return NULL;
+        }
+        if ((err = snd_pcm_sw_params_set_silence_size(pcm_handle, swparams, boundary)) < 0) {
+            fprintf(stderr, "snd_pcm_sw_params_set_silence_size: %s\n", snd_strerror(err));
+            return NULL;
+        }
+    }
     
     // We want to at least be able to write this amount of data
-    if ((err = snd_pcm_sw_params_set_avail_min(pcm_handle, swparams, 256)) < 0) {
+    if ((err = snd_pcm_sw_params_set_avail_min(pcm_handle, swparams, config->avail_min)) < 0) {
         fprintf(stderr, "snd_pcm_sw_params_set_avail_min: %s\n", snd_strerror(err));
         return NULL;
     }
@@ -16,12 +16,26 @@ extern "C"
 {
 #endif
     
+    /* Buffer geometry and access mode of a PCM */
+    typedef struct {
+        unsigned int periods;
+        snd_pcm_uframes_t period_frames;
+        snd_pcm_uframes_t avail_min;        /* wake up when this much is available */
+        snd_pcm_uframes_t start_threshold;  /* playback starts when this much is queued */
+        snd_pcm_access_t access;
+        int mode;                           /* snd_pcm_open mode, SND_PCM_NONBLOCK for poll() */
+        int free_run;                       /* playback never stops, plays silence when starved */
+    } alsa_config_t;
+    
     const char* alsa_state_str(snd_pcm_state_t state);
     
+    /* Fill config from a named profile, "default", "low_latency" or "throughput".
+     Returns -EINVAL on unknown names. */
+    int alsa_config_profile(const char* name, alsa_config_t *config);
+    
     snd_pcm_t* alsa_pcm_handle(const char* pcm_name,
                                unsigned int rate,
-                               const unsigned int periods,
-                               snd_pcm_uframes_t frames,
+                               const alsa_config_t *config,
                                snd_pcm_stream_t stream);
     
 #ifdef __cplusplus
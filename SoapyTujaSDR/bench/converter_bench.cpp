@@ -0,0 +1,113 @@
+//
+//  converter_bench.cpp
+//  SoapyTujaSDR
+//
+
+// Micro benchmark of every converter to and from CS32, ours (VECTORIZED)
+// and SoapySDR's own (GENERIC), aligned and unaligned, for block sizes
+// matching our period sizes. Prints CSV to stdout.
+//
+// usage: converter_bench [min_time_ms]
+
+#include <SoapySDR/ConverterRegistry.hpp>
+#include <SoapySDR/Formats.hpp>
+#include <volk/volk.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef SoapySDR::ConverterRegistry Registry;
+
+static const size_t blockSizes[] = {128, 1024, 4096, 65536};
+
+static const char *priorityName(const Registry::FunctionPriority priority)
+{
+    switch (priority) {
+        case Registry::GENERIC: return "GENERIC";
+        case Registry::VECTORIZED: return "VECTORIZED";
+        case Registry::CUSTOM: return "CUSTOM";
+    }
+    return "UNKNOWN";
+}
+
+static void bench(const std::string &source,
+                  const std::string &target,
+                  const Registry::FunctionPriority priority,
+                  const bool aligned,
+                  const size_t numElems,
+                  const double minTime)
+{
+    const Registry::ConverterFunction func = Registry::getFunction(source, target, priority);
+    const size_t srcSize = SoapySDR::formatToSize(source);
+    const size_t dstSize = SoapySDR::formatToSize(target);
+    
+    // One extra element so the unaligned run can be offset by one
+    uint8_t *src = (uint8_t *) volk_malloc((numElems + 1) * srcSize, volk_get_alignment());
+    uint8_t *dst = (uint8_t *) volk_malloc((numElems + 1) * dstSize, volk_get_alignment());
+    
+    // Something that isn't all zeros, in range for every format
+    for (size_t i = 0; i < (numElems + 1) * srcSize; i++) {
+        src[i] = (uint8_t)(rand() & 0x3f);
+    }
+    
+    const uint8_t *srcBuff = aligned ? src : src + srcSize;
+    uint8_t *dstBuff = aligned ? dst : dst + dstSize;
+    
+    // warm up
+    func(srcBuff, dstBuff, numElems, 1.0);
+    
+    size_t iterations = 0;
+    double elapsed = 0;
+    size_t batch = 1;
+    const auto start = std::chrono::steady_clock::now();
+    while (elapsed < minTime) {
+        for (size_t i = 0; i < batch; i++) {
+            func(srcBuff, dstBuff, numElems, 1.0);
+        }
+        iterations += batch;
+        batch *= 2;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    
+    const double samples = double(iterations) * numElems;
+    const double bytes = samples * (srcSize + dstSize);
+    
+    printf("%s,%s,%s,%s,%zu,%.3f,%.3f\n",
+           source.c_str(), target.c_str(), priorityName(priority),
+           aligned ? "aligned" : "unaligned", numElems,
+           elapsed * 1e9 / samples, bytes / elapsed / 1e9);
+    
+    volk_free(src);
+    volk_free(dst);
+}
+
+int main(int argc, char *argv[])
+{
+    const double minTime = (argc > 1 ? atof(argv[1]) : 100.0) / 1000.0;
+    
+    // Every converter with CS32 on one side
+    std::vector<std::pair<std::string, std::string>> pairs;
+    for (const std::string &target : Registry::listTargetFormats(SOAPY_SDR_CS32)) {
+        pairs.push_back(std::make_pair(std::string(SOAPY_SDR_CS32), target));
+    }
+    for (const std::string &source : Registry::listSourceFormats(SOAPY_SDR_CS32)) {
+        if (source != SOAPY_SDR_CS32) {
+            pairs.push_back(std::make_pair(source, std::string(SOAPY_SDR_CS32)));
+        }
+    }
+    
+    printf("source,target,priority,alignment,num_elems,ns_per_sample,gb_per_s\n");
+    for (const auto &pair : pairs) {
+        for (const Registry::FunctionPriority priority : Registry::listPriorities(pair.first, pair.second)) {
+            for (const size_t numElems : blockSizes) {
+                bench(pair.first, pair.second, priority, true, numElems, minTime);
+                bench(pair.first, pair.second, priority, false, numElems, minTime);
+            }
+        }
+    }
+    
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,231 @@
+//
+//  stream_bench.cpp
+//  SoapyTujaSDR
+//
+
+// End to end streaming benchmark. Runs readStream and/or writeStream as
+// fast as the device allows and prints CSV with sustained samples/s,
+// per call latency percentiles and XRUN counts. --sensors true dumps the
+// driver's health sensors to stderr afterwards.
+//
+// Without hardware build with -Dtuja_mock=true and point it at an ALSA
+// stand-in, "null" runs unthrottled, snd-aloop runs at the real rate:
+//
+//   stream_bench --args driver=tujasdr,alsadevice=null
+//   stream_bench --args driver=tujasdr,alsadevice=hw:Loopback,1,0 --direction rx
+
+#include <SoapySDR/Device.hpp>
+#include <SoapySDR/Formats.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Options
+{
+    std::string args = "driver=tujasdr";
+    std::string streamArgs;
+    std::string format = SOAPY_SDR_CS32;
+    std::string direction = "both";
+    double seconds = 10.0;
+    size_t elems = 0; // 0 = stream MTU
+    bool sensors = false;
+};
+
+struct Result
+{
+    size_t samples = 0;
+    size_t calls = 0;
+    size_t xruns = 0;
+    size_t timeouts = 0;
+    size_t errors = 0;
+    double elapsed = 0;
+    std::vector<float> latencies; // us per call
+};
+
+static SoapySDR::Kwargs parseKwargs(const std::string &str)
+{
+    SoapySDR::Kwargs kwargs;
+    size_t pos = 0;
+    while (pos < str.size()) {
+        size_t end = str.find(',', pos);
+        if (end == std::string::npos) {
+            end = str.size();
+        }
+        const std::string pair = str.substr(pos, end - pos);
+        const size_t eq = pair.find('=');
+        if (eq != std::string::npos) {
+            kwargs[pair.substr(0, eq)] = pair.substr(eq + 1);
+        }
+        pos = end + 1;
+    }
+    return kwargs;
+}
+
+// Setup, activation and teardown stay on the main thread, the driver's
+// control API isn't thread safe. Only the loops run concurrently.
+static SoapySDR::Stream *setup(SoapySDR::Device *device, const int direction, const Options &opts, Result &result)
+{
+    try {
+        SoapySDR::Stream *stream = device->setupStream(direction, opts.format, std::vector<size_t>(),
+                                                       parseKwargs(opts.streamArgs));
+        result.latencies.reserve(1 << 20);
+        device->activateStream(stream);
+        return stream;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "stream_bench: %s\n", e.what());
+        result.errors++;
+        return nullptr;
+    }
+}
+
+static void teardown(SoapySDR::Device *device, SoapySDR::Stream *stream)
+{
+    device->deactivateStream(stream);
+    device->closeStream(stream);
+}
+
+static void streamLoop(SoapySDR::Device *device, SoapySDR::Stream *stream, const int direction,
+                       const Options &opts, Result &result)
+{
+    const size_t elems = opts.elems ? opts.elems : device->getStreamMTU(stream);
+    std::vector<uint8_t> buff(elems * SoapySDR::formatToSize(opts.format));
+    void *buffs[] = {buff.data()};
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto stop = start + std::chrono::duration<double>(opts.seconds);
+    auto now = start;
+    while (now < stop) {
+        int flags = 0;
+        long long timeNs = 0;
+        int ret;
+        if (direction == SOAPY_SDR_RX) {
+            ret = device->readStream(stream, buffs, elems, flags, timeNs);
+        } else {
+            ret = device->writeStream(stream, buffs, elems, flags);
+        }
+        const auto then = now;
+        now = std::chrono::steady_clock::now();
+
+        result.calls++;
+        if (result.latencies.size() < result.latencies.capacity()) {
+            result.latencies.push_back(std::chrono::duration<float, std::micro>(now - then).count());
+        }
+        if (ret > 0) {
+            result.samples += ret;
+        } else if (ret == SOAPY_SDR_OVERFLOW or ret == SOAPY_SDR_UNDERFLOW) {
+            result.xruns++;
+        } else if (ret == SOAPY_SDR_TIMEOUT) {
+            result.timeouts++;
+        } else if (ret < 0) {
+            result.errors++;
+        }
+    }
+    result.elapsed = std::chrono::duration<double>(now - start).count();
+}
+
+// Exceptions don't cross threads, report them here
+static void run(SoapySDR::Device *device, SoapySDR::Stream *stream, const int direction,
+                const Options &opts, Result &result)
+{
+    try {
+        streamLoop(device, stream, direction, opts, result);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "stream_bench: %s\n", e.what());
+        result.errors++;
+    }
+}
+
+static float percentile(const std::vector<float> &sorted, const double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+static void report(const char *direction, const Options &opts, Result &result)
+{
+    std::sort(result.latencies.begin(), result.latencies.end());
+    printf("%s,%s,%.3f,%zu,%.0f,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%zu,%zu,%zu\n",
+           direction, opts.format.c_str(), result.elapsed, result.samples,
+           result.samples / result.elapsed, result.calls,
+           percentile(result.latencies, 0.5),
+           percentile(result.latencies, 0.9),
+           percentile(result.latencies, 0.99),
+           percentile(result.latencies, 0.999),
+           result.latencies.empty() ? 0.0f : result.latencies.back(),
+           result.xruns, result.timeouts, result.errors);
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string key = argv[i];
+        const std::string value = argv[i + 1];
+        if (key == "--args") opts.args = value;
+        else if (key == "--stream-args") opts.streamArgs = value;
+        else if (key == "--format") opts.format = value;
+        else if (key == "--direction") opts.direction = value;
+        else if (key == "--seconds") opts.seconds = atof(value.c_str());
+        else if (key == "--elems") opts.elems = strtoul(value.c_str(), nullptr, 0);
+        else if (key == "--sensors") opts.sensors = value == "true";
+        else {
+            fprintf(stderr, "usage: %s [--args k=v,...] [--stream-args k=v,...] [--format CS32] "
+                    "[--direction rx|tx|both] [--seconds 10] [--elems MTU] [--sensors false]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    SoapySDR::Device *device = SoapySDR::Device::make(opts.args);
+
+    const bool rx = opts.direction == "rx" or opts.direction == "both";
+    const bool tx = opts.direction == "tx" or opts.direction == "both";
+    Result rxResult, txResult;
+
+    SoapySDR::Stream *rxStream = rx ? setup(device, SOAPY_SDR_RX, opts, rxResult) : nullptr;
+    SoapySDR::Stream *txStream = tx ? setup(device, SOAPY_SDR_TX, opts, txResult) : nullptr;
+
+    std::thread txThread;
+    if (txStream != nullptr) {
+        txThread = std::thread(run, device, txStream, SOAPY_SDR_TX, std::cref(opts), std::ref(txResult));
+    }
+    if (rxStream != nullptr) {
+        run(device, rxStream, SOAPY_SDR_RX, opts, rxResult);
+    }
+    if (txThread.joinable()) {
+        txThread.join();
+    }
+
+    if (rxStream != nullptr) {
+        teardown(device, rxStream);
+    }
+    if (txStream != nullptr) {
+        teardown(device, txStream);
+    }
+
+    printf("direction,format,seconds,samples,samples_per_s,calls,"
+           "p50_us,p90_us,p99_us,p999_us,max_us,xruns,timeouts,errors\n");
+    if (rx) {
+        report("rx", opts, rxResult);
+    }
+    if (tx) {
+        report("tx", opts, txResult);
+    }
+
+    if (opts.sensors) {
+        for (const std::string &key : device->listSensors()) {
+            fprintf(stderr, "%s: %s\n", key.c_str(), device->readSensor(key).c_str());
+        }
+    }
+    
+    SoapySDR::Device::unmake(device);
+    return rxResult.errors or txResult.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
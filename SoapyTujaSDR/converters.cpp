@@ -0,0 +1,346 @@
+//
+//  converters.cpp
+//  SoapyTujaSDR
+//
+
+// VOLK accelerated converters between the native CS32 format and the
+// formats we offer to clients.
+//
+// The scaler is a linear gain on top of the full scale mapping, 1.0 maps
+// full scale to full scale. It is folded into the conversion so gain costs
+// nothing extra. Float to integer conversions always saturate, that's what
+// the VOLK kernels do.
+//
+// VOLK has no integer to integer kernels so those go through float in
+// chunks small enough to stay in L1.
+//
+// The narrow integer formats also come dithered, see converters.hpp.
+
+#include "converters.hpp"
+#include <volk/volk.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// Scalars (not elements) per chunk
+static const size_t chunkSize = 2048;
+
+// 2 samples per element
+static const size_t elemDepth = 2;
+
+// Full scale of each format
+static const float fullScaleS32 = 2147483647.0f; // 2^31
+static const float fullScaleS16 = 32768.0f;      // 2^15
+static const float fullScaleS12 = 2048.0f;       // 2^11
+static const float fullScaleS8 = 128.0f;         // 2^7
+
+// TPDF dither, two uniform variables of one LSB each summed, in LSB
+// units. Made once and read from a random offset per chunk, repeating
+// every ditherSize scalars is far from anything audible in a spectrum.
+static const size_t ditherSize = 1 << 14;
+
+static const float *ditherNoise()
+{
+    static const std::vector<float> noise = [] {
+        // chunkSize extra so a chunk never wraps
+        std::vector<float> v(ditherSize + chunkSize);
+        std::minstd_rand rng(1);
+        std::uniform_real_distribution<float> uniform(-0.5f, 0.5f);
+        for (float &x : v) {
+            x = uniform(rng) + uniform(rng);
+        }
+        return v;
+    }();
+    return noise.data();
+}
+
+// Add dither to a chunk scaled to LSB units of the target format, the
+// rounding in the conversion that follows does the rest
+static void dither(float *tmp, const unsigned int n)
+{
+    // xorshift, per thread so streams don't share state
+    static thread_local uint32_t state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    volk_32f_x2_add_32f(tmp, tmp, ditherNoise() + state % ditherSize, n);
+}
+
+// Offset binary and two's complement bytes differ in the sign bit. Eight
+// at a time in a 64 bit word, VOLK has no byte XOR.
+static void flipSignBits(uint8_t *dst, const uint8_t *src, const size_t n)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, src + i, sizeof(word));
+        word ^= 0x8080808080808080ull;
+        std::memcpy(dst + i, &word, sizeof(word));
+    }
+    for (; i < n; i++) {
+        dst[i] = src[i] ^ 0x80;
+    }
+}
+
+// CS32 => CF32
+static void volkCS32toCF32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    // volk divides by the scaling factor
+    const float scaling_factor = fullScaleS32 / scaler;
+
+    volk_32i_s32f_convert_32f((float*)dstBuff, (const int32_t*)srcBuff, scaling_factor,
+                              static_cast<unsigned int>(numElems * elemDepth));
+}
+
+// CF32 => CS32
+static void volkCF32toCS32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    const float scaling_factor = fullScaleS32 * scaler;
+
+    volk_32f_s32f_convert_32i((int32_t*)dstBuff, (const float*)srcBuff, scaling_factor,
+                              static_cast<unsigned int>(numElems * elemDepth));
+}
+
+// CS32 => CF64
+static void volkCS32toCF64(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) float tmp[chunkSize];
+    const int32_t *src = (const int32_t*)srcBuff;
+    double *dst = (double*)dstBuff;
+    const float scaling_factor = fullScaleS32 / scaler;
+
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const unsigned int n = std::min(chunkSize, numElems * elemDepth - i);
+        volk_32i_s32f_convert_32f(tmp, src + i, scaling_factor, n);
+        volk_32f_convert_64f(dst + i, tmp, n);
+    }
+}
+
+// CF64 => CS32
+static void volkCF64toCS32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) float tmp[chunkSize];
+    const double *src = (const double*)srcBuff;
+    int32_t *dst = (int32_t*)dstBuff;
+    const float scaling_factor = fullScaleS32 * scaler;
+
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const unsigned int n = std::min(chunkSize, numElems * elemDepth - i);
+        volk_64f_convert_32f(tmp, src + i, n);
+        volk_32f_s32f_convert_32i(dst + i, tmp, scaling_factor, n);
+    }
+}
+
+// CS32 => CS32, only needed for gain. In place is fine, each chunk is
+// read out before it is written back.
+static void volkCS32toCS32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) float tmp[chunkSize];
+    const int32_t *src = (const int32_t*)srcBuff;
+    int32_t *dst = (int32_t*)dstBuff;
+
+    if (scaler == 1.0) {
+        if (src != dst) {
+            std::memcpy(dst, src, numElems * elemDepth * sizeof(int32_t));
+        }
+        return;
+    }
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const unsigned int n = std::min(chunkSize, numElems * elemDepth - i);
+        volk_32i_s32f_convert_32f(tmp, src + i, 1.0f / (float) scaler, n);
+        volk_32f_s32f_convert_32i(dst + i, tmp, 1.0f, n);
+    }
+}
+
+// CS32 => CS16
+template <bool dithered>
+static void volkCS32toCS16(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) float tmp[chunkSize];
+    const int32_t *src = (const int32_t*)srcBuff;
+    int16_t *dst = (int16_t*)dstBuff;
+    // Scale straight to S16 units in the first pass
+    const float scaling_factor = (fullScaleS32 / fullScaleS16) / scaler;
+
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const unsigned int n = std::min(chunkSize, numElems * elemDepth - i);
+        volk_32i_s32f_convert_32f(tmp, src + i, scaling_factor, n);
+        if (dithered) {
+            dither(tmp, n);
+        }
+        volk_32f_s32f_convert_16i(dst + i, tmp, 1.0f, n);
+    }
+}
+
+// CS16 => CS32
+static void volkCS16toCS32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) float tmp[chunkSize];
+    const int16_t *src = (const int16_t*)srcBuff;
+    int32_t *dst = (int32_t*)dstBuff;
+    const float scaling_factor = (fullScaleS32 / fullScaleS16) * scaler;
+
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const unsigned int n = std::min(chunkSize, numElems * elemDepth - i);
+        volk_16i_s32f_convert_32f(tmp, src + i, 1.0f, n);
+        volk_32f_s32f_convert_32i(dst + i, tmp, scaling_factor, n);
+    }
+}
+
+// CS32 => CS12, packed the way SoapyRemote does it. Three bytes per
+// element: I bits 0-7, I bits 8-11 and Q bits 0-3, Q bits 4-11.
+template <bool dithered>
+static void volkCS32toCS12(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) float tmp[chunkSize];
+    alignas(64) int16_t tmp16[chunkSize];
+    const int32_t *src = (const int32_t*)srcBuff;
+    uint8_t *dst = (uint8_t*)dstBuff;
+    const float scaling_factor = (fullScaleS32 / fullScaleS12) / scaler;
+
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const unsigned int n = std::min(chunkSize, numElems * elemDepth - i);
+        volk_32i_s32f_convert_32f(tmp, src + i, scaling_factor, n);
+        if (dithered) {
+            dither(tmp, n);
+        }
+        volk_32f_s32f_convert_16i(tmp16, tmp, 1.0f, n);
+        // saturate to 12 bits and pack, scalar, the compiler doesn't
+        // vectorize the 3 byte stride
+        uint8_t *out = dst + i / elemDepth * 3;
+        for (size_t j = 0; j < n; j += elemDepth) {
+            const int16_t re = std::min<int16_t>(std::max<int16_t>(tmp16[j], -2048), 2047);
+            const int16_t im = std::min<int16_t>(std::max<int16_t>(tmp16[j + 1], -2048), 2047);
+            out[0] = (uint8_t) re;
+            out[1] = (uint8_t) (((re >> 8) & 0x0f) | ((uint16_t) im << 4));
+            out[2] = (uint8_t) (im >> 4);
+            out += 3;
+        }
+    }
+}
+
+// CS12 => CS32, unpacked to the top of a CS16 first
+static void volkCS12toCS32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) int16_t tmp16[chunkSize];
+    alignas(64) float tmp[chunkSize];
+    const uint8_t *src = (const uint8_t*)srcBuff;
+    int32_t *dst = (int32_t*)dstBuff;
+    const float scaling_factor = (fullScaleS32 / fullScaleS16) * scaler;
+
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const unsigned int n = std::min(chunkSize, numElems * elemDepth - i);
+        const uint8_t *in = src + i / elemDepth * 3;
+        for (size_t j = 0; j < n; j += elemDepth) {
+            tmp16[j] = (int16_t) ((in[1] << 12) | (in[0] << 4));
+            tmp16[j + 1] = (int16_t) ((in[2] << 8) | (in[1] & 0xf0));
+            in += 3;
+        }
+        volk_16i_s32f_convert_32f(tmp, tmp16, 1.0f, n);
+        volk_32f_s32f_convert_32i(dst + i, tmp, scaling_factor, n);
+    }
+}
+
+// CS32 => CS8
+template <bool dithered>
+static void volkCS32toCS8(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) float tmp[chunkSize];
+    const int32_t *src = (const int32_t*)srcBuff;
+    int8_t *dst = (int8_t*)dstBuff;
+    const float scaling_factor = (fullScaleS32 / fullScaleS8) / scaler;
+
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const unsigned int n = std::min(chunkSize, numElems * elemDepth - i);
+        volk_32i_s32f_convert_32f(tmp, src + i, scaling_factor, n);
+        if (dithered) {
+            dither(tmp, n);
+        }
+        volk_32f_s32f_convert_8i(dst + i, tmp, 1.0f, n);
+    }
+}
+
+// CS8 => CS32
+static void volkCS8toCS32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) float tmp[chunkSize];
+    const int8_t *src = (const int8_t*)srcBuff;
+    int32_t *dst = (int32_t*)dstBuff;
+    const float scaling_factor = (fullScaleS32 / fullScaleS8) * scaler;
+
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const unsigned int n = std::min(chunkSize, numElems * elemDepth - i);
+        volk_8i_s32f_convert_32f(tmp, src + i, 1.0f, n);
+        volk_32f_s32f_convert_32i(dst + i, tmp, scaling_factor, n);
+    }
+}
+
+// CS32 => CU8, offset binary is CS8 with the sign bit flipped
+template <bool dithered>
+static void volkCS32toCU8(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    uint8_t *dst = (uint8_t*)dstBuff;
+
+    volkCS32toCS8<dithered>(srcBuff, dstBuff, numElems, scaler);
+    flipSignBits(dst, dst, numElems * elemDepth);
+}
+
+// CU8 => CS32
+static void volkCU8toCS32(const void *srcBuff, void *dstBuff, const size_t numElems, const double scaler)
+{
+    alignas(64) int8_t tmp[chunkSize];
+    const uint8_t *src = (const uint8_t*)srcBuff;
+    int32_t *dst = (int32_t*)dstBuff;
+
+    for (size_t i = 0; i < numElems * elemDepth; i += chunkSize) {
+        const size_t n = std::min(chunkSize, numElems * elemDepth - i);
+        flipSignBits((uint8_t *) tmp, src + i, n);
+        volkCS8toCS32(tmp, dst + i, n / elemDepth, scaler);
+    }
+}
+
+// Register format converters
+static SoapySDR::ConverterRegistry registerVolkCS32toCF32(SOAPY_SDR_CS32, SOAPY_SDR_CF32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS32toCF32);
+
+static SoapySDR::ConverterRegistry registerVolkCF32toCS32(SOAPY_SDR_CF32, SOAPY_SDR_CS32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCF32toCS32);
+
+static SoapySDR::ConverterRegistry registerVolkCS32toCF64(SOAPY_SDR_CS32, SOAPY_SDR_CF64, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS32toCF64);
+
+static SoapySDR::ConverterRegistry registerVolkCF64toCS32(SOAPY_SDR_CF64, SOAPY_SDR_CS32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCF64toCS32);
+
+static SoapySDR::ConverterRegistry registerVolkCS32toCS32(SOAPY_SDR_CS32, SOAPY_SDR_CS32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS32toCS32);
+
+static SoapySDR::ConverterRegistry registerVolkCS32toCS16(SOAPY_SDR_CS32, SOAPY_SDR_CS16, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS32toCS16<false>);
+
+static SoapySDR::ConverterRegistry registerVolkCS16toCS32(SOAPY_SDR_CS16, SOAPY_SDR_CS32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS16toCS32);
+
+static SoapySDR::ConverterRegistry registerVolkCS32toCS12(SOAPY_SDR_CS32, SOAPY_SDR_CS12, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS32toCS12<false>);
+
+static SoapySDR::ConverterRegistry registerVolkCS12toCS32(SOAPY_SDR_CS12, SOAPY_SDR_CS32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS12toCS32);
+
+static SoapySDR::ConverterRegistry registerVolkCS32toCS8(SOAPY_SDR_CS32, SOAPY_SDR_CS8, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS32toCS8<false>);
+
+static SoapySDR::ConverterRegistry registerVolkCS8toCS32(SOAPY_SDR_CS8, SOAPY_SDR_CS32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS8toCS32);
+
+static SoapySDR::ConverterRegistry registerVolkCS32toCU8(SOAPY_SDR_CS32, SOAPY_SDR_CU8, SoapySDR::ConverterRegistry::VECTORIZED, &volkCS32toCU8<false>);
+
+static SoapySDR::ConverterRegistry registerVolkCU8toCS32(SOAPY_SDR_CU8, SOAPY_SDR_CS32, SoapySDR::ConverterRegistry::VECTORIZED, &volkCU8toCS32);
+
+SoapySDR::ConverterRegistry::ConverterFunction ditheredConverter(const std::string &format)
+{
+    if (format == SOAPY_SDR_CS16) {
+        return &volkCS32toCS16<true>;
+    }
+    if (format == SOAPY_SDR_CS12) {
+        return &volkCS32toCS12<true>;
+    }
+    if (format == SOAPY_SDR_CS8) {
+        return &volkCS32toCS8<true>;
+    }
+    if (format == SOAPY_SDR_CU8) {
+        return &volkCS32toCU8<true>;
+    }
+    return nullptr;
+}
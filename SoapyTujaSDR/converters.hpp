@@ -0,0 +1,15 @@
+//
+//  converters.hpp
+//  SoapyTujaSDR
+//
+
+#pragma once
+
+#include <SoapySDR/ConverterRegistry.hpp>
+#include <string>
+
+// The registry converters, CS32 to CS16, CS12, CS8 or CU8, with TPDF
+// dither of one LSB of the target format. Not registered, the registry
+// has no way to ask for them, the device picks them by hand. nullptr for
+// other formats.
+SoapySDR::ConverterRegistry::ConverterFunction ditheredConverter(const std::string &format);
@@ -0,0 +1,571 @@
+//
+//  dsp.cpp
+//  SoapyTujaSDR
+//
+
+#include "dsp.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Same mapping as the CS32 converters
+static const float fullScaleS32 = 2147483647.0f; // 2^31
+
+// Windowed sinc low pass for a rate change by factor. The passband ends at
+// 0.4 and the stopband starts at 0.6 of the low rate, so aliases and images
+// only land in the band edges. With Blackman-Harris and 32 taps per factor
+// the stopband is 65 dB down at its edge and better than 120 dB further
+// out. Unity gain at DC.
+static void designLowpass(const size_t factor, VolkBuffer<float> &taps)
+{
+    if (factor == 1) {
+        taps.assign(1, 1.0f);
+        return;
+    }
+    
+    const size_t length = 32 * factor + 1;
+    const double cutoff = 0.5 / factor;
+    double sum = 0;
+    
+    taps.assign(length, 0);
+    for (size_t i = 0; i < length; i++) {
+        const double x = i - (length - 1) / 2.0;
+        const double sinc = x == 0 ? 2 * cutoff : std::sin(2 * M_PI * cutoff * x) / (M_PI * x);
+        const double w = 2 * M_PI * i / (length - 1);
+        const double window = 0.35875 - 0.48829 * std::cos(w) +
+        0.14128 * std::cos(2 * w) - 0.01168 * std::cos(3 * w);
+        taps[i] = (float) (sinc * window);
+        sum += taps[i];
+    }
+    for (size_t i = 0; i < length; i++) {
+        taps[i] = (float) (taps[i] / sum);
+    }
+}
+
+// Estimators step once per block of this many frames, however the stream
+// is sliced, long enough that the signal itself averages out. Each step the
+// residual DC goes 20% of the way and the image shrinks by 20% (E[y^2] is
+// twice the image coefficient times the power). At the full rate that's
+// settled in about a second.
+static const size_t estimateFrames = 8192;
+static const float dcOffsetGain = 0.2f;
+static const float balanceGain = 0.1f;
+
+IqCorrector::IqCorrector() :
+d_dc_offset(0),
+d_balance(0),
+d_auto_dc_offset(false),
+d_auto_balance(false),
+d_sum(0),
+d_sum_squares(0),
+d_power(0),
+d_count(0)
+{
+    d_bias.assign(chunkFrames, lv_cmake(0.0f, 0.0f));
+    d_image.assign(chunkFrames, lv_cmake(0.0f, 0.0f));
+    d_ones.assign(chunkFrames, 1.0f);
+}
+
+void IqCorrector::setDcOffset(const lv_32fc_t offset)
+{
+    if (offset != d_dc_offset) {
+        d_dc_offset = offset;
+        std::fill(d_bias.data(), d_bias.data() + d_bias.size(), -offset);
+    }
+}
+
+void IqCorrector::process(lv_32fc_t *x, const size_t n)
+{
+    lv_32fc_t sum;
+    float power;
+    
+    if (d_auto_dc_offset or d_dc_offset != lv_cmake(0.0f, 0.0f)) {
+        volk_32f_x2_add_32f((float *) x, (const float *) x, (const float *) d_bias.data(), 2 * n);
+    }
+    if (d_auto_balance or d_balance != lv_cmake(0.0f, 0.0f)) {
+        volk_32fc_conjugate_32fc(d_image.data(), x, n);
+        volk_32fc_s32fc_multiply_32fc(d_image.data(), d_image.data(), d_balance, n);
+        volk_32f_x2_add_32f((float *) x, (const float *) x, (const float *) d_image.data(), 2 * n);
+    }
+    
+    if (d_auto_dc_offset) {
+        volk_32fc_32f_dot_prod_32fc(&sum, x, d_ones.data(), n);
+        d_sum += sum;
+    }
+    if (d_auto_balance) {
+        volk_32fc_x2_dot_prod_32fc(&sum, x, x, n);
+        d_sum_squares += sum;
+        volk_32f_x2_dot_prod_32f(&power, (const float *) x, (const float *) x, 2 * n);
+        d_power += power;
+    }
+    d_count += n;
+}
+
+void IqCorrector::update()
+{
+    if (d_count < estimateFrames) {
+        return;
+    }
+    if (d_auto_dc_offset) {
+        setDcOffset(d_dc_offset + dcOffsetGain * d_sum / (float) d_count);
+    }
+    if (d_auto_balance and d_power > 0) {
+        d_balance -= balanceGain * d_sum_squares / d_power;
+    }
+    d_sum = 0;
+    d_sum_squares = 0;
+    d_power = 0;
+    d_count = 0;
+}
+
+int IqCorrector::setLocked(const bool locked)
+{
+    int err = d_bias.setLocked(locked);
+    err = std::min(err, d_image.setLocked(locked));
+    return std::min(err, d_ones.setLocked(locked));
+}
+
+Ddc::Ddc() :
+d_decimation(0),
+d_offset(0),
+d_nco_phase(1),
+d_nco_step(1),
+d_phase(0)
+{
+    setDecimation(1);
+}
+
+void Ddc::setDecimation(const size_t decimation)
+{
+    if (decimation == d_decimation or decimation == 0) {
+        return;
+    }
+    d_decimation = decimation;
+    designLowpass(d_decimation, d_taps);
+    d_work.assign(d_taps.size() - 1 + chunkFrames, 0);
+    d_out.assign(chunkFrames / d_decimation + 1, 0);
+    reset();
+}
+
+void Ddc::setOffset(const double offset)
+{
+    d_offset = offset;
+    d_nco_step = lv_cmake((float) std::cos(2 * M_PI * offset), (float) std::sin(2 * M_PI * offset));
+}
+
+void Ddc::reset()
+{
+    std::fill(d_work.data(), d_work.data() + d_work.size(), lv_cmake(0.0f, 0.0f));
+    d_nco_phase = lv_cmake(1.0f, 0.0f);
+    d_phase = 0;
+}
+
+size_t Ddc::process(const lv_32fc_t *in, const size_t numIn, int32_t *out)
+{
+    lv_32fc_t *fresh = d_work.data() + d_taps.size() - 1;
+    size_t produced = 0;
+    
+    for (size_t i = 0; i < numIn; ) {
+        const size_t n = std::min(chunkFrames, numIn - i);
+        
+        // Mixing out of place saves the copy
+        if (d_offset != 0) {
+            volk_32fc_s32fc_x2_rotator_32fc(fresh, in + i, d_nco_step, &d_nco_phase, n);
+        } else {
+            memcpy(fresh, in + i, n * sizeof(lv_32fc_t));
+        }
+        produced += filter(n, out + 2 * produced);
+        i += n;
+    }
+    return produced;
+}
+
+size_t Ddc::filter(const size_t n, int32_t *out)
+{
+    const size_t history = d_taps.size() - 1;
+    
+    if (d_decimation == 1) {
+        // Only the mixer
+        volk_32f_s32f_convert_32i(out, (const float *) (d_work.data() + history), fullScaleS32, 2 * n);
+        return n;
+    }
+    
+    // Output k is due once input d_phase + k * decimation is in,
+    // the window ending there starts history samples back.
+    size_t outputs = 0;
+    size_t p = d_phase;
+    for (; p < n; p += d_decimation) {
+        volk_32fc_32f_dot_prod_32fc(d_out.data() + outputs, d_work.data() + p,
+                                    d_taps.data(), (unsigned int) d_taps.size());
+        outputs++;
+    }
+    d_phase = p - n;
+    volk_32f_s32f_convert_32i(out, (const float *) d_out.data(), fullScaleS32, 2 * outputs);
+    memmove(d_work.data(), d_work.data() + n, history * sizeof(lv_32fc_t));
+    return outputs;
+}
+
+int Ddc::setLocked(const bool locked)
+{
+    int err = d_taps.setLocked(locked);
+    err = std::min(err, d_work.setLocked(locked));
+    return std::min(err, d_out.setLocked(locked));
+}
+
+Duc::Duc() :
+d_interpolation(0),
+d_offset(0),
+d_branch_taps(1),
+d_nco_phase(1),
+d_nco_step(1)
+{
+    setInterpolation(1);
+}
+
+void Duc::setInterpolation(const size_t interpolation)
+{
+    if (interpolation == d_interpolation or interpolation == 0) {
+        return;
+    }
+    d_interpolation = interpolation;
+    
+    // Split the prototype into one branch per output phase. Branch p holds
+    // taps p, p + L, p + 2L, ... time reversed so a dot product over the
+    // input history gives output phase p. Scaled by L since only one in L
+    // of the upsampled inputs is non zero.
+    VolkBuffer<float> prototype;
+    designLowpass(d_interpolation, prototype);
+    d_branch_taps = (prototype.size() + d_interpolation - 1) / d_interpolation;
+    d_taps.assign(d_interpolation * d_branch_taps, 0);
+    for (size_t p = 0; p < d_interpolation; p++) {
+        for (size_t k = 0; k < d_branch_taps; k++) {
+            const size_t i = p + k * d_interpolation;
+            if (i < prototype.size()) {
+                d_taps[p * d_branch_taps + d_branch_taps - 1 - k] = prototype[i] * d_interpolation;
+            }
+        }
+    }
+    d_work.assign(d_branch_taps - 1 + chunkFrames, 0);
+    d_out.assign(chunkFrames * d_interpolation, 0);
+    reset();
+}
+
+void Duc::setOffset(const double offset)
+{
+    d_offset = offset;
+    d_nco_step = lv_cmake((float) std::cos(2 * M_PI * offset), (float) std::sin(2 * M_PI * offset));
+}
+
+void Duc::reset()
+{
+    std::fill(d_work.data(), d_work.data() + d_work.size(), lv_cmake(0.0f, 0.0f));
+    d_nco_phase = lv_cmake(1.0f, 0.0f);
+}
+
+size_t Duc::process(const int32_t *in, const size_t numIn, int32_t *out)
+{
+    const size_t history = d_branch_taps - 1;
+    lv_32fc_t *fresh = d_work.data() + history;
+    size_t produced = 0;
+    
+    for (size_t i = 0; i < numIn; ) {
+        const size_t n = std::min(chunkFrames, numIn - i);
+        const size_t outputs = n * d_interpolation;
+        
+        volk_32i_s32f_convert_32f((float *) fresh, in + 2 * i, fullScaleS32, 2 * n);
+        if (d_interpolation == 1) {
+            // Only the mixer
+            memcpy(d_out.data(), fresh, n * sizeof(lv_32fc_t));
+        } else {
+            for (size_t j = 0; j < n; j++) {
+                for (size_t p = 0; p < d_interpolation; p++) {
+                    volk_32fc_32f_dot_prod_32fc(d_out.data() + j * d_interpolation + p, d_work.data() + j,
+                                                d_taps.data() + p * d_branch_taps,
+                                                (unsigned int) d_branch_taps);
+                }
+            }
+            memmove(d_work.data(), d_work.data() + n, history * sizeof(lv_32fc_t));
+        }
+        if (d_offset != 0) {
+            volk_32fc_s32fc_x2_rotator_32fc(d_out.data(), d_out.data(), d_nco_step, &d_nco_phase, outputs);
+        }
+        volk_32f_s32f_convert_32i(out + 2 * produced, (const float *) d_out.data(), fullScaleS32, 2 * outputs);
+        produced += outputs;
+        i += n;
+    }
+    return produced;
+}
+
+int Duc::setLocked(const bool locked)
+{
+    int err = d_taps.setLocked(locked);
+    err = std::min(err, d_work.setLocked(locked));
+    return std::min(err, d_out.setLocked(locked));
+}
+
+Channelizer::Channelizer() :
+d_decimation(1),
+d_locked(false)
+{
+    d_in.assign(chunkFrames, lv_cmake(0.0f, 0.0f));
+    setNumChannels(1);
+}
+
+void Channelizer::setNumChannels(const size_t numChannels)
+{
+    d_ddcs.clear();
+    for (size_t i = 0; i < numChannels; i++) {
+        d_ddcs.emplace_back(new Ddc());
+        d_ddcs.back()->setDecimation(d_decimation);
+        d_ddcs.back()->setLocked(d_locked);
+    }
+}
+
+void Channelizer::setDecimation(const size_t decimation)
+{
+    d_decimation = decimation;
+    for (auto &ddc : d_ddcs) {
+        ddc->setDecimation(decimation);
+    }
+}
+
+bool Channelizer::active() const
+{
+    if (d_frontend.active()) {
+        return true;
+    }
+    for (const auto &ddc : d_ddcs) {
+        if (ddc->active()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Channelizer::reset()
+{
+    for (auto &ddc : d_ddcs) {
+        ddc->reset();
+    }
+}
+
+size_t Channelizer::process(const int32_t *in, const size_t numIn, int32_t * const *outs)
+{
+    size_t produced = 0;
+    
+    for (size_t i = 0; i < numIn; ) {
+        const size_t n = std::min(chunkFrames, numIn - i);
+        
+        volk_32i_s32f_convert_32f((float *) d_in.data(), in + 2 * i, fullScaleS32, 2 * n);
+        if (d_frontend.active()) {
+            // while the chunk is still in cache
+            d_frontend.process(d_in.data(), n);
+        }
+        // Same decimation and phase, so every channel yields the same count
+        size_t outputs = 0;
+        for (size_t c = 0; c < d_ddcs.size(); c++) {
+            outputs = d_ddcs[c]->process(d_in.data(), n, outs[c] + 2 * produced);
+        }
+        produced += outputs;
+        i += n;
+    }
+    d_frontend.update();
+    return produced;
+}
+
+int Channelizer::setLocked(const bool locked)
+{
+    d_locked = locked;
+    int err = d_in.setLocked(locked);
+    err = std::min(err, d_frontend.setLocked(locked));
+    for (auto &ddc : d_ddcs) {
+        err = std::min(err, ddc->setLocked(locked));
+    }
+    return err;
+}
+
+Fft::Fft() :
+d_size(0)
+{
+}
+
+void Fft::setSize(const size_t size)
+{
+    const size_t half = size / 2;
+    size_t stages = 0;
+    while (((size_t) 1 << stages) < size) {
+        stages++;
+    }
+    
+    // Stage k splits into transforms of n = size >> k interleaved with
+    // stride s = 1 << k, element i of the difference gets w_n^(i / s)
+    d_size = size;
+    d_twiddles.assign(stages * half, lv_cmake(1.0f, 0.0f));
+    for (size_t k = 0; k < stages; k++) {
+        const size_t n = size >> k;
+        for (size_t i = 0; i < half; i++) {
+            const double angle = -2 * M_PI * (i >> k) / n;
+            d_twiddles[k * half + i] = lv_cmake((float) std::cos(angle), (float) std::sin(angle));
+        }
+    }
+    d_work.assign(size, lv_cmake(0.0f, 0.0f));
+    d_sum.assign(half, lv_cmake(0.0f, 0.0f));
+    d_difference.assign(half, lv_cmake(0.0f, 0.0f));
+}
+
+void Fft::forward(lv_32fc_t *x)
+{
+    const size_t half = d_size / 2;
+    lv_32fc_t *src = x;
+    lv_32fc_t *dst = d_work.data();
+    
+    for (size_t k = 0, s = 1; s < d_size; k++, s *= 2) {
+        // Butterflies between the halves, as whole vectors
+        volk_32f_x2_add_32f((float *) d_sum.data(), (const float *) src,
+                            (const float *) (src + half), 2 * half);
+        volk_32f_x2_subtract_32f((float *) d_difference.data(), (const float *) src,
+                                 (const float *) (src + half), 2 * half);
+        volk_32fc_x2_multiply_32fc(d_difference.data(), d_difference.data(),
+                                   d_twiddles.data() + k * half, half);
+        // Runs of s go back interleaved, sum then difference
+        if (s == 1) {
+            for (size_t i = 0; i < half; i++) {
+                dst[2 * i] = d_sum[i];
+                dst[2 * i + 1] = d_difference[i];
+            }
+        } else {
+            for (size_t i = 0; i < half; i += s) {
+                std::memcpy(dst + 2 * i, d_sum.data() + i, s * sizeof(lv_32fc_t));
+                std::memcpy(dst + 2 * i + s, d_difference.data() + i, s * sizeof(lv_32fc_t));
+            }
+        }
+        std::swap(src, dst);
+    }
+    if (src != x) {
+        std::memcpy(x, src, d_size * sizeof(lv_32fc_t));
+    }
+}
+
+int Fft::setLocked(const bool locked)
+{
+    int err = d_twiddles.setLocked(locked);
+    err = std::min(err, d_work.setLocked(locked));
+    err = std::min(err, d_sum.setLocked(locked));
+    return std::min(err, d_difference.setLocked(locked));
+}
+
+Spectrum::Spectrum() :
+d_window_gain(1.0f),
+d_count(0)
+{
+}
+
+bool Spectrum::hasWindow(const std::string &window)
+{
+    return window == "rectangular" or window == "hann" or window == "blackman_harris";
+}
+
+void Spectrum::setSize(const size_t size, const std::string &window)
+{
+    double sum = 0;
+    
+    d_fft.setSize(size);
+    d_window.assign(size, 1.0f);
+    for (size_t i = 0; i < size; i++) {
+        const double w = 2 * M_PI * i / size;
+        if (window == "hann") {
+            d_window[i] = (float) (0.5 - 0.5 * std::cos(w));
+        } else if (window == "blackman_harris") {
+            d_window[i] = (float) (0.35875 - 0.48829 * std::cos(w) +
+                                   0.14128 * std::cos(2 * w) - 0.01168 * std::cos(3 * w));
+        }
+        sum += d_window[i];
+    }
+    d_window_gain = (float) sum;
+    d_frame.assign(size, lv_cmake(0.0f, 0.0f));
+    d_magnitude.assign(size, 0);
+    d_sum.assign(size, 0);
+    d_count = 0;
+}
+
+void Spectrum::add(const int32_t *in)
+{
+    const size_t n = size();
+    
+    volk_32i_s32f_convert_32f((float *) d_frame.data(), in, fullScaleS32, 2 * n);
+    volk_32fc_32f_multiply_32fc(d_frame.data(), d_frame.data(), d_window.data(), n);
+    d_fft.forward(d_frame.data());
+    volk_32fc_magnitude_squared_32f(d_magnitude.data(), d_frame.data(), n);
+    volk_32f_x2_add_32f(d_sum.data(), d_sum.data(), d_magnitude.data(), n);
+    d_count++;
+}
+
+void Spectrum::power(float *out)
+{
+    const size_t n = size();
+    const float scale = 1.0f / (std::max<size_t>(d_count, 1) * d_window_gain * d_window_gain);
+    
+    // Once per output, a plain loop will do. Negative frequencies first.
+    for (size_t i = 0; i < n; i++) {
+        out[i] = 10.0f * std::log10(d_sum[(i + n / 2) % n] * scale + 1e-20f);
+    }
+    std::fill(d_sum.data(), d_sum.data() + n, 0.0f);
+    d_count = 0;
+}
+
+constexpr double Agc::minGain;
+constexpr double Agc::maxGain;
+constexpr double Agc::targetPeak;
+constexpr double Agc::decayRate;
+
+int Spectrum::setLocked(const bool locked)
+{
+    int err = d_fft.setLocked(locked);
+    err = std::min(err, d_window.setLocked(locked));
+    err = std::min(err, d_frame.setLocked(locked));
+    err = std::min(err, d_magnitude.setLocked(locked));
+    return std::min(err, d_sum.setLocked(locked));
+}
+
+Agc::Agc() :
+d_gain(0),
+d_scale(1.0),
+d_automatic(false)
+{
+}
+
+void Agc::setGain(const double gain)
+{
+    d_gain = std::min(std::max(gain, minGain), maxGain);
+    d_scale = std::pow(10.0, d_gain / 20.0);
+}
+
+float Agc::peak(const int32_t *x, const size_t numSamples)
+{
+    alignas(64) float tmp[chunkSamples];
+    float peak = 0;
+    
+    // Squared, so the largest magnitude is the largest value
+    for (size_t i = 0; i < numSamples; i += chunkSamples) {
+        const unsigned int n = (unsigned int) std::min(chunkSamples, numSamples - i);
+        uint32_t index;
+        volk_32i_s32f_convert_32f(tmp, x + i, fullScaleS32, n);
+        volk_32f_x2_multiply_32f(tmp, tmp, tmp, n);
+        volk_32f_index_max_32u(&index, tmp, n);
+        peak = std::max(peak, tmp[index]);
+    }
+    return std::sqrt(peak);
+}
+
+void Agc::update(const float peak, const double seconds)
+{
+    if (not d_automatic) {
+        return;
+    }
+    // Recover slowly, but never past what puts this block's peak on target
+    double gain = d_gain + decayRate * seconds;
+    if (peak > 0) {
+        gain = std::min(gain, targetPeak - 20.0 * std::log10(peak));
+    }
+    setGain(gain);
+}
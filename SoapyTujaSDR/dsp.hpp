@@ -0,0 +1,338 @@
+//
+//  dsp.hpp
+//  SoapyTujaSDR
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <volk/volk.h>
+#include "volkbuffer.hpp"
+
+/*
+ Signal processing between ALSA and the format converters. Blocks take and
+ give native CS32 so they slot in front of the existing converters, and
+ work in float internally with VOLK doing the heavy lifting.
+ */
+
+// Front end correction, in place on CF32 scaled to +-1. Subtracts the DC
+// offset, then cancels the image left by IQ gain and phase imbalance with
+// y = x + balance * conj(x). Either can be fixed or tracked, the estimators
+// gather statistics in process and update takes a step once they've seen a
+// block's worth.
+class IqCorrector
+{
+public:
+    static const size_t chunkFrames = 2048;
+
+private:
+    lv_32fc_t d_dc_offset;
+    lv_32fc_t d_balance;
+    bool d_auto_dc_offset;
+    bool d_auto_balance;
+    VolkBuffer<lv_32fc_t> d_bias;   // -d_dc_offset, chunkFrames of it
+    VolkBuffer<lv_32fc_t> d_image;
+    VolkBuffer<float> d_ones;
+    lv_32fc_t d_sum;                // of y, residual DC
+    lv_32fc_t d_sum_squares;        // of y * y, zero without an image
+    float d_power;                  // of |y|^2
+    size_t d_count;
+
+public:
+    IqCorrector();
+    
+    IqCorrector(const IqCorrector&) = delete;
+    IqCorrector& operator=(const IqCorrector&) = delete;
+    
+    // Fixed values, or the starting point for the estimators
+    void setDcOffset(const lv_32fc_t offset);
+    lv_32fc_t dcOffset() const { return d_dc_offset; }
+    void setBalance(const lv_32fc_t balance) { d_balance = balance; }
+    lv_32fc_t balance() const { return d_balance; }
+    
+    void setAutoDcOffset(const bool automatic) { d_auto_dc_offset = automatic; }
+    bool autoDcOffset() const { return d_auto_dc_offset; }
+    void setAutoBalance(const bool automatic) { d_auto_balance = automatic; }
+    bool autoBalance() const { return d_auto_balance; }
+    
+    bool active() const
+    {
+        return d_auto_dc_offset or d_auto_balance or
+        d_dc_offset != lv_cmake(0.0f, 0.0f) or d_balance != lv_cmake(0.0f, 0.0f);
+    }
+    
+    // At most chunkFrames
+    void process(lv_32fc_t *x, const size_t n);
+    
+    // Call after each process, estimators step once a block is in
+    void update();
+    
+    // Keep the working buffers locked in memory, see VolkBuffer::setLocked
+    int setLocked(const bool locked);
+};
+
+// Digital downconverter. An NCO shifts the wanted signal to DC, then a
+// windowed sinc low pass decimates by an integer factor. The filter is
+// evaluated polyphase style, only at the outputs that are kept.
+class Ddc
+{
+public:
+    static const size_t chunkFrames = 2048;
+
+private:
+    size_t d_decimation;
+    double d_offset;            // cycles per input sample
+    VolkBuffer<float> d_taps;
+    VolkBuffer<lv_32fc_t> d_work; // filter history followed by a chunk of input
+    VolkBuffer<lv_32fc_t> d_out;
+    lv_32fc_t d_nco_phase;
+    lv_32fc_t d_nco_step;
+    size_t d_phase;             // inputs until the next output
+    
+    // Decimates the n mixed inputs at the end of d_work
+    size_t filter(const size_t n, int32_t *out);
+
+public:
+    Ddc();
+    
+    Ddc(const Ddc&) = delete;
+    Ddc& operator=(const Ddc&) = delete;
+    
+    // Redesigns the filter and clears history, unless it's unchanged
+    void setDecimation(const size_t decimation);
+    size_t decimation() const { return d_decimation; }
+    
+    // Frequency moved to DC, in cycles per input sample. Keeps the NCO
+    // phase so retuning is glitch free.
+    void setOffset(const double offset);
+    double offset() const { return d_offset; }
+    
+    bool active() const { return d_decimation > 1 or d_offset != 0; }
+    
+    // Input samples before the next output is produced, and the filter
+    // group delay. The next output is centered on input phase() - delay().
+    size_t phase() const { return d_phase; }
+    size_t delay() const { return (d_taps.size() - 1) / 2; }
+    
+    // CF32 scaled to +-1 in, CS32 out. out must hold numIn / decimation() + 1
+    // frames. Returns frames written.
+    size_t process(const lv_32fc_t *in, const size_t numIn, int32_t *out);
+    
+    void reset();
+    
+    // Keep the working buffers locked in memory, see VolkBuffer::setLocked
+    int setLocked(const bool locked);
+};
+
+// Digital upconverter. A windowed sinc interpolator raises the rate by an
+// integer factor, then an NCO shifts DC up to the wanted frequency. The
+// filter is split polyphase style into one short branch per output phase
+// run over the input, so the zeros of the upsampled signal are never
+// multiplied.
+class Duc
+{
+public:
+    static const size_t chunkFrames = 512; // inputs
+
+private:
+    size_t d_interpolation;
+    double d_offset;            // cycles per output sample
+    size_t d_branch_taps;
+    VolkBuffer<float> d_taps;   // branches back to back
+    VolkBuffer<lv_32fc_t> d_work; // filter history followed by a chunk of input
+    VolkBuffer<lv_32fc_t> d_out;
+    lv_32fc_t d_nco_phase;
+    lv_32fc_t d_nco_step;
+
+public:
+    Duc();
+    
+    Duc(const Duc&) = delete;
+    Duc& operator=(const Duc&) = delete;
+    
+    // Redesigns the filter and clears history, unless it's unchanged
+    void setInterpolation(const size_t interpolation);
+    size_t interpolation() const { return d_interpolation; }
+    
+    // Frequency DC is moved to, in cycles per output sample. Keeps the NCO
+    // phase so retuning is glitch free.
+    void setOffset(const double offset);
+    double offset() const { return d_offset; }
+    
+    bool active() const { return d_interpolation > 1 or d_offset != 0; }
+    
+    // CS32 in and out, out must hold numIn * interpolation() frames.
+    // Returns frames written.
+    size_t process(const int32_t *in, const size_t numIn, int32_t *out);
+    
+    void reset();
+    
+    // Keep the working buffers locked in memory, see VolkBuffer::setLocked
+    int setLocked(const bool locked);
+};
+
+// Bank of downconverters fed from one capture, one per virtual channel.
+// The capture is converted to float and front end corrected once per
+// chunk and shared, each channel then only pays for its own mixer and the
+// outputs it keeps. All channels decimate by the same factor and are reset
+// together so they stay sample aligned.
+class Channelizer
+{
+public:
+    static const size_t chunkFrames = Ddc::chunkFrames;
+
+private:
+    size_t d_decimation;
+    std::vector<std::unique_ptr<Ddc>> d_ddcs;
+    IqCorrector d_frontend;
+    VolkBuffer<lv_32fc_t> d_in;
+    bool d_locked;
+
+public:
+    Channelizer();
+    
+    Channelizer(const Channelizer&) = delete;
+    Channelizer& operator=(const Channelizer&) = delete;
+    
+    // Starts over with fresh channels at the current decimation
+    void setNumChannels(const size_t numChannels);
+    size_t numChannels() const { return d_ddcs.size(); }
+    
+    void setDecimation(const size_t decimation);
+    size_t decimation() const { return d_decimation; }
+    
+    // See Ddc::setOffset
+    void setOffset(const size_t channel, const double offset) { d_ddcs.at(channel)->setOffset(offset); }
+    
+    // DC offset and IQ balance, kept across setNumChannels
+    IqCorrector &frontend() { return d_frontend; }
+    const IqCorrector &frontend() const { return d_frontend; }
+    
+    // The front end or any channel needs processing
+    bool active() const;
+    
+    // Shared by all channels
+    size_t phase() const { return d_ddcs.front()->phase(); }
+    size_t delay() const { return d_ddcs.front()->delay(); }
+    
+    // CS32 in, one CS32 buffer per channel out, each must hold
+    // numIn / decimation() + 1 frames. Returns frames written per channel.
+    size_t process(const int32_t *in, const size_t numIn, int32_t * const *outs);
+    
+    void reset();
+    
+    // Keep the working buffers locked in memory, channels added later too,
+    // see VolkBuffer::setLocked
+    int setLocked(const bool locked);
+};
+
+// Radix 2 FFT in the Stockham arrangement. The output comes out in
+// natural order without a bit reversal pass, and every stage is a few VOLK
+// kernels over half the data rather than short butterfly loops.
+class Fft
+{
+private:
+    size_t d_size;
+    VolkBuffer<lv_32fc_t> d_twiddles;   // size / 2 per stage
+    VolkBuffer<lv_32fc_t> d_work;
+    VolkBuffer<lv_32fc_t> d_sum;
+    VolkBuffer<lv_32fc_t> d_difference;
+
+public:
+    Fft();
+    
+    Fft(const Fft&) = delete;
+    Fft& operator=(const Fft&) = delete;
+    
+    // A power of two
+    void setSize(const size_t size);
+    size_t size() const { return d_size; }
+    
+    // Forward transform in place, unnormalized
+    void forward(lv_32fc_t *x);
+    
+    // Keep the working buffers locked in memory, see VolkBuffer::setLocked
+    int setLocked(const bool locked);
+};
+
+// Power spectrum of CS32 frames. Each frame is windowed and transformed,
+// the powers are summed and power hands out their mean in dB relative to a
+// full scale tone, with DC in the middle.
+class Spectrum
+{
+private:
+    Fft d_fft;
+    VolkBuffer<float> d_window;
+    VolkBuffer<lv_32fc_t> d_frame;
+    VolkBuffer<float> d_magnitude;
+    VolkBuffer<float> d_sum;
+    float d_window_gain;                // sum of the window, a tone's peak
+    size_t d_count;
+
+public:
+    Spectrum();
+    
+    Spectrum(const Spectrum&) = delete;
+    Spectrum& operator=(const Spectrum&) = delete;
+    
+    // rectangular, hann or blackman_harris
+    static bool hasWindow(const std::string &window);
+    
+    // A power of two and a window, drops anything added
+    void setSize(const size_t size, const std::string &window);
+    size_t size() const { return d_fft.size(); }
+    
+    // One frame of size() samples
+    void add(const int32_t *in);
+    size_t count() const { return d_count; }
+    
+    // size() bins, then starts over
+    void power(float *out);
+    
+    // Keep the working buffers locked in memory, see VolkBuffer::setLocked
+    int setLocked(const bool locked);
+};
+
+// Gain for the format converters, in dB. Fixed, or automatic: each block's
+// peak is measured before it is converted, so the gain drops in time for
+// the block that would clip and then recovers at decayRate. This keeps
+// weak signals out of the bottom bits of CS16 and CS8. Applying the gain
+// costs nothing, it rides along in the conversion.
+class Agc
+{
+public:
+    static constexpr double minGain = 0.0;
+    static constexpr double maxGain = 60.0;
+    static constexpr double targetPeak = -3.0;  // dBFS
+    static constexpr double decayRate = 10.0;   // dB per second
+
+private:
+    static const size_t chunkSamples = 2048;
+    
+    double d_gain;
+    double d_scale;
+    bool d_automatic;
+
+public:
+    Agc();
+    
+    // Fixed value, or the starting point when automatic
+    void setGain(const double gain);
+    double gain() const { return d_gain; }
+    
+    void setAutomatic(const bool automatic) { d_automatic = automatic; }
+    bool automatic() const { return d_automatic; }
+    
+    // Linear, the converter scaler
+    double scale() const { return d_scale; }
+    
+    // Largest magnitude of I or Q, full scale is 1.0
+    static float peak(const int32_t *x, const size_t numSamples);
+    
+    // Adjust for a block with this peak at unity gain lasting seconds
+    void update(const float peak, const double seconds);
+};
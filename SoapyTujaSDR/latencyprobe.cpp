@@ -0,0 +1,71 @@
+//
+//  latencyprobe.cpp
+//  SoapyTujaSDR
+//
+
+#include "latencyprobe.hpp"
+#include <cmath>
+#include <vector>
+
+// Peak must stand this far above the average to count
+static const float minQuality = 8.0f;
+
+LatencyProbe::LatencyProbe()
+{
+    // Fibonacci LFSR, x^10 + x^7 + 1 is primitive
+    const unsigned order = 10;
+    unsigned state = 1;
+    
+    d_chips.assign((1u << order) - 1, 0);
+    for (size_t i = 0; i < d_chips.size(); i++) {
+        d_chips[i] = state & 1 ? 1.0f : -1.0f;
+        const unsigned bit = (state ^ (state >> 3)) & 1;
+        state = (state >> 1) | (bit << (order - 1));
+    }
+}
+
+void LatencyProbe::generate(int32_t *frames, const long offset, const size_t numFrames) const
+{
+    // Quarter scale on both I and Q, leaves headroom for the loopback
+    const float amplitude = 1 << 29;
+    
+    for (size_t i = 0; i < numFrames; i++) {
+        const long chip = offset + (long) i;
+        int32_t value = 0;
+        if (chip >= 0 and chip < (long) d_chips.size()) {
+            value = (int32_t) (amplitude * d_chips[chip]);
+        }
+        frames[2 * i] = value;
+        frames[2 * i + 1] = value;
+    }
+}
+
+long LatencyProbe::correlate(const std::complex<float> *capture, const size_t numFrames, float &quality) const
+{
+    quality = 0;
+    if (numFrames < length()) {
+        return -1;
+    }
+    
+    const size_t lags = numFrames - length() + 1;
+    std::vector<float> magnitude(lags);
+    double sum = 0;
+    size_t best = 0;
+    
+    for (size_t lag = 0; lag < lags; lag++) {
+        lv_32fc_t acc;
+        volk_32fc_32f_dot_prod_32fc(&acc, capture + lag, d_chips.data(), length());
+        magnitude[lag] = std::abs(acc);
+        sum += magnitude[lag];
+        if (magnitude[lag] > magnitude[best]) {
+            best = lag;
+        }
+    }
+    
+    const double mean = sum / lags;
+    if (mean <= 0) {
+        return -1;
+    }
+    quality = magnitude[best] / mean;
+    return quality < minQuality ? -1 : (long) best;
+}
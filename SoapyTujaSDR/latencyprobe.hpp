@@ -0,0 +1,39 @@
+//
+//  latencyprobe.hpp
+//  SoapyTujaSDR
+//
+
+#pragma once
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include "volkbuffer.hpp"
+
+/*
+ Round trip latency measurement over a loopback.
+ 
+ A maximum length sequence is played on TX and located in the RX capture
+ by cross correlation. The sequence has a single sharp autocorrelation
+ peak, so the lag is exact to the sample whatever the phase and gain of
+ the loopback.
+ */
+class LatencyProbe
+{
+private:
+    VolkBuffer<float> d_chips; // +-1
+
+public:
+    // 2^10 - 1 chips, about 11 ms at 89286 Hz
+    LatencyProbe();
+    
+    size_t length() const { return d_chips.size(); }
+    
+    // CS32 frames of the sequence, offset counts chips from its start
+    // and anything outside the sequence is silence.
+    void generate(int32_t *frames, const long offset, const size_t numFrames) const;
+    
+    // Lag of the first chip in the capture or -1 if there is no clear
+    // peak. quality is the peak over the mean correlation magnitude.
+    long correlate(const std::complex<float> *capture, const size_t numFrames, float &quality) const;
+};
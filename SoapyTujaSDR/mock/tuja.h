@@ -0,0 +1,27 @@
+//
+//  tuja.h
+//  SoapyTujaSDR
+//
+
+// Stand-in for libtuja so the driver can be built and benchmarked without
+// TujaSDR hardware. Mirrors the subset of the API the driver uses.
+// Enable with: meson -Dtuja_mock=true build
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    
+    typedef struct tuja tuja_t;
+    
+    int tuja_open(const char* i2c_device, int address, tuja_t **tuja);
+    void tuja_close(tuja_t *tuja);
+    int tuja_set_frequency(tuja_t *tuja, uint32_t frequency);
+    
+#ifdef __cplusplus
+}
+#endif
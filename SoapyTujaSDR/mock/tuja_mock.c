@@ -0,0 +1,45 @@
+//
+//  tuja_mock.c
+//  SoapyTujaSDR
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "tuja.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct tuja {
+    uint32_t frequency;
+    long delay_us; /* emulated I2C transaction time */
+};
+
+int tuja_open(const char* i2c_device, int address, tuja_t **tuja) {
+    const char *delay = getenv("TUJA_MOCK_DELAY_US");
+    
+    *tuja = calloc(1, sizeof(struct tuja));
+    if (*tuja == NULL) {
+        return -ENOMEM;
+    }
+    (*tuja)->delay_us = delay ? atol(delay) : 0;
+    return 0;
+}
+
+void tuja_close(tuja_t *tuja) {
+    free(tuja);
+}
+
+int tuja_set_frequency(tuja_t *tuja, uint32_t frequency) {
+    if (tuja == NULL) {
+        return -EBADF;
+    }
+    if (tuja->delay_us > 0) {
+        struct timespec ts;
+        ts.tv_sec = tuja->delay_us / 1000000;
+        ts.tv_nsec = (tuja->delay_us % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+    tuja->frequency = frequency;
+    return 0;
+}
@@ -0,0 +1,116 @@
+//
+//  realtime.c
+//  SoapyTujaSDR
+//
+
+/* CPU_SET and pthread_setaffinity_np */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "realtime.h"
+#include <alloca.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+int rt_parse_cpus(const char* list, cpu_set_t *cpus) {
+    
+    const char *p = list;
+    char *end;
+    
+    CPU_ZERO(cpus);
+    while (*p != '\0') {
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return -EINVAL;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return -EINVAL;
+            }
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return -EINVAL;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+int rt_thread_setup(const rt_config_t *config) {
+    
+    int err;
+    
+    if (CPU_COUNT(&config->cpus) > 0) {
+        err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &config->cpus);
+        if (err != 0) {
+            return -err;
+        }
+    }
+    
+    if (config->priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->priority;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            return -err;
+        }
+    }
+    return 0;
+}
+
+int rt_lock_memory(void *addr, size_t len) {
+    
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    volatile char *p = (volatile char *) addr;
+    
+    if (addr == NULL || len == 0) {
+        return 0;
+    }
+    if (mlock(addr, len) < 0) {
+        return -errno;
+    }
+    /* mlock faults pages in already, writing makes sure copy on write
+     and zero pages are resolved too. Contents are preserved. */
+    for (size_t i = 0; i < len; i += page_size) {
+        p[i] = p[i];
+    }
+    return 0;
+}
+
+int rt_unlock_memory(void *addr, size_t len) {
+    
+    if (addr == NULL || len == 0) {
+        return 0;
+    }
+    if (munlock(addr, len) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+void rt_prefault_stack(size_t len) {
+    
+    volatile char *stack = alloca(len);
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    
+    for (size_t i = 0; i < len; i += page_size) {
+        stack[i] = 0;
+    }
+}
@@ -0,0 +1,42 @@
+//
+//  realtime.h
+//  SoapyTujaSDR
+//
+
+#pragma once
+
+#include <sched.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    
+    /* Scheduling of the threads doing streaming I/O */
+    typedef struct {
+        int priority;       /* SCHED_FIFO priority, 0 leaves the policy alone */
+        cpu_set_t cpus;     /* empty leaves the affinity alone */
+        int lock_memory;    /* mlock and prefault stream buffers */
+    } rt_config_t;
+    
+    /* Parse a CPU list like "3", "2,3" or "0-1" into cpus.
+     Returns -EINVAL on malformed lists. */
+    int rt_parse_cpus(const char* list, cpu_set_t *cpus);
+    
+    /* Apply priority and affinity to the calling thread, returns 0 or -errno.
+     Needs CAP_SYS_NICE (or an rtprio limit) for SCHED_FIFO. */
+    int rt_thread_setup(const rt_config_t *config);
+    
+    /* Lock a buffer in memory and touch every page so the hot path never
+     takes a page fault. Returns 0 or -errno, usually -ENOMEM or -EPERM
+     when over RLIMIT_MEMLOCK. */
+    int rt_lock_memory(void *addr, size_t len);
+    int rt_unlock_memory(void *addr, size_t len);
+    
+    /* Touch this much of the calling thread's stack */
+    void rt_prefault_stack(size_t len);
+    
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,372 @@
+//
+//  recorder.cpp
+//  SoapyTujaSDR
+//
+
+#include "recorder.hpp"
+#include "volkbuffer.hpp"
+#include <SoapySDR/Formats.hpp>
+#include <SoapySDR/Logger.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Seconds of capture the ring holds while the disk stalls
+static const double queueSeconds = 8.0;
+
+// SigMF name of each format we record, little endian like the Pi
+static std::string sigmfDatatype(const std::string &format)
+{
+    if (format == SOAPY_SDR_CS32) {
+        return "ci32_le";
+    }
+    if (format == SOAPY_SDR_CS16) {
+        return "ci16_le";
+    }
+    if (format == SOAPY_SDR_CS8) {
+        return "ci8";
+    }
+    if (format == SOAPY_SDR_CU8) {
+        return "cu8";
+    }
+    if (format == SOAPY_SDR_CF32) {
+        return "cf32_le";
+    }
+    if (format == SOAPY_SDR_CF64) {
+        return "cf64_le";
+    }
+    return "";
+}
+
+Recorder::Recorder() :
+d_sample_rate(0),
+d_frequency(0),
+d_channels(0),
+d_block_frames(0),
+d_converter(nullptr),
+d_active(false),
+d_pushing(false),
+d_dropped(0),
+d_captured(0),
+d_gap_dropped(0),
+d_gap_overrun(false),
+d_stop(false),
+d_event(-1),
+d_fd(-1)
+{
+}
+
+Recorder::~Recorder()
+{
+    stop();
+}
+
+void Recorder::start(const std::string &path,
+                     const std::string &format,
+                     const double sampleRate,
+                     const size_t channels,
+                     const double frequency)
+{
+    stop();
+    std::lock_guard<std::mutex> lock(d_control_mutex);
+    
+    d_datatype = sigmfDatatype(format);
+    if (d_datatype.empty()) {
+        throw std::runtime_error("Recorder: can't record " + format);
+    }
+    // Native frames go to disk as they are
+    d_converter = nullptr;
+    if (format != SOAPY_SDR_CS32) {
+        d_converter = SoapySDR::ConverterRegistry::getFunction(SOAPY_SDR_CS32, format);
+        if (d_converter == nullptr) {
+            throw std::runtime_error("Recorder: SoapySDR::ConverterRegistry function not found: " + format);
+        }
+    }
+    
+    // Room for a few blocks at least, the writer waits for whole ones.
+    // Blocks are whole output blocks, more captured frames when narrower.
+    const size_t frameSize = channels * sizeof(int32_t);
+    d_block_frames = blockBytes / (SoapySDR::formatToSize(format) * channels / 2);
+    const size_t frames = std::max<size_t>((size_t) (sampleRate * queueSeconds),
+                                           4 * d_block_frames);
+    d_data.reset(new RingBuffer(frames, frameSize));
+    d_gaps.reset(new RingBuffer(1024, sizeof(Gap)));
+    
+    const std::string dataPath = path + ".sigmf-data";
+    d_fd = ::open(dataPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (d_fd < 0) {
+        throw std::runtime_error("Recorder: " + dataPath + ": " + std::string(strerror(errno)));
+    }
+    d_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (d_event < 0) {
+        ::close(d_fd);
+        d_fd = -1;
+        throw std::runtime_error("Recorder: eventfd: " + std::string(strerror(errno)));
+    }
+    
+    // When the first sample is about to arrive
+    const auto now = std::chrono::system_clock::now();
+    const std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+    const long ms = (long) (std::chrono::duration_cast<std::chrono::milliseconds>(
+        now.time_since_epoch()).count() % 1000);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    char datetime[64];
+    const size_t length = strftime(datetime, sizeof(datetime), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(datetime + length, sizeof(datetime) - length, ".%03ldZ", ms);
+    d_datetime = datetime;
+    
+    d_path = path;
+    d_format = format;
+    d_sample_rate = sampleRate;
+    d_frequency = frequency;
+    d_channels = channels;
+    d_log.clear();
+    d_dropped = 0;
+    d_captured = 0;
+    d_gap_dropped = 0;
+    d_gap_overrun = false;
+    d_stop = false;
+    d_thread = std::thread(&Recorder::run, this);
+    // push starts copying from here
+    d_active = true;
+    
+    SoapySDR_logf(SOAPY_SDR_INFO, "Recorder: recording %s to %s", format.c_str(), dataPath.c_str());
+}
+
+void Recorder::stop()
+{
+    std::lock_guard<std::mutex> lock(d_control_mutex);
+    
+    if (not d_thread.joinable()) {
+        return;
+    }
+    // Wait out a push in progress, after this the capture path won't
+    // touch the rings
+    d_active = false;
+    while (d_pushing) {
+        std::this_thread::yield();
+    }
+    // The writer drains the ring before it exits
+    d_stop = true;
+    wake();
+    d_thread.join();
+    // Still dropping at the end, there is no data after it to mark
+    if (d_gap_dropped > 0) {
+        SoapySDR_logf(SOAPY_SDR_WARNING, "Recorder: disk too slow, dropped the last %" PRIu64
+                      " frames", d_gap_dropped);
+        d_log.push_back({d_data->writeIndex(), d_captured, d_gap_dropped, d_gap_overrun});
+    }
+    
+    writeMeta();
+    ::close(d_fd);
+    d_fd = -1;
+    ::close(d_event);
+    d_event = -1;
+    
+    SoapySDR_logf(SOAPY_SDR_INFO, "Recorder: %s done, %" PRIu64 " frames written, %" PRIu64 " dropped",
+                  d_path.c_str(), d_data->readIndex(), dropped());
+    d_data.reset();
+    d_gaps.reset();
+    d_path.clear();
+}
+
+std::string Recorder::path() const
+{
+    std::lock_guard<std::mutex> lock(d_control_mutex);
+    return d_path;
+}
+
+void Recorder::push(const int32_t *frames, const size_t numFrames)
+{
+    // seq_cst against stop, either it sees us here or we see it stopped
+    d_pushing = true;
+    if (d_active) {
+        const bool gap = d_gap_dropped > 0 or d_gap_overrun;
+        // Once dropping wait for the writer to free a block, or every
+        // small read that squeezes in makes another gap
+        const size_t needed = numFrames + (d_gap_dropped > 0 ? d_block_frames : 0);
+        if (d_data->writeAvailable() < needed or (gap and d_gaps->writeAvailable() == 0)) {
+            // The disk is behind, drop the block rather than wait
+            d_gap_dropped += numFrames;
+            d_dropped.fetch_add(numFrames, std::memory_order_relaxed);
+        } else {
+            if (gap) {
+                Gap *g = (Gap *) d_gaps->writePtr();
+                g->offset = d_data->writeIndex();
+                g->index = d_captured;
+                g->dropped = d_gap_dropped;
+                g->overrun = d_gap_overrun;
+                d_gaps->commitWrite(1);
+                d_gap_dropped = 0;
+                d_gap_overrun = false;
+            }
+            std::memcpy(d_data->writePtr(), frames, numFrames * d_data->frameSize());
+            d_data->commitWrite(numFrames);
+            // Only when this made a block, a writer behind is awake anyway
+            const size_t queued = d_data->readAvailable();
+            if (queued >= d_block_frames and queued < d_block_frames + numFrames) {
+                wake();
+            }
+        }
+        d_captured += numFrames;
+    }
+    d_pushing = false;
+}
+
+void Recorder::overrun()
+{
+    d_pushing = true;
+    if (d_active) {
+        d_gap_overrun = true;
+    }
+    d_pushing = false;
+}
+
+void Recorder::wake()
+{
+    const uint64_t one = 1;
+    
+    // EAGAIN means a wakeup is pending already
+    if (::write(d_event, &one, sizeof(one)) < 0 and errno != EAGAIN) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "Recorder: wake: %s", strerror(errno));
+    }
+}
+
+void Recorder::run()
+{
+    const size_t frameSize = d_data->frameSize();
+    const size_t blockFrames = d_block_frames;
+    const size_t outFrameSize = SoapySDR::formatToSize(d_format) * d_channels / 2;
+    VolkBuffer<uint8_t> out;
+    if (d_converter != nullptr) {
+        out.assign(blockBytes, 0);
+    }
+    bool failed = false;
+    
+    for (;;) {
+        // Checked first so nothing pushed before stop is missed below
+        const bool stopping = d_stop.load(std::memory_order_acquire);
+        // A gap only ever points at data not written yet
+        while (d_gaps->readAvailable() > 0) {
+            const Gap gap = *(const Gap *) d_gaps->readPtr();
+            d_gaps->commitRead(1);
+            if (gap.dropped > 0) {
+                SoapySDR_logf(SOAPY_SDR_WARNING, "Recorder: disk too slow, dropped %" PRIu64
+                              " frames at %" PRIu64, gap.dropped, gap.index - gap.dropped);
+            }
+            d_log.push_back(gap);
+        }
+        
+        // Whole blocks only until the end
+        const size_t frames = std::min(d_data->readAvailable(), blockFrames);
+        if (frames < blockFrames and not stopping) {
+            // Until push fills a block or stop, the counter makes sure a
+            // wakeup after the check above isn't lost
+            struct pollfd pfd = {d_event, POLLIN, 0};
+            if (poll(&pfd, 1, -1) > 0) {
+                uint64_t count;
+                if (::read(d_event, &count, sizeof(count)) < 0) {
+                    // nothing pending, fine
+                }
+            }
+            continue;
+        }
+        if (frames == 0) {
+            return;
+        }
+        // After an error keep draining so capture sees no difference
+        if (not failed) {
+            const void *data = d_data->readPtr();
+            size_t bytes = frames * frameSize;
+            if (d_converter != nullptr) {
+                d_converter(data, out.data(), frames * d_channels / 2, 1.0);
+                data = out.data();
+                bytes = frames * outFrameSize;
+            }
+            failed = not writeData(data, bytes);
+        }
+        d_data->commitRead(frames);
+    }
+}
+
+bool Recorder::writeData(const void *data, size_t bytes)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    
+    while (bytes > 0) {
+        const ssize_t n = ::write(d_fd, p, bytes);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            SoapySDR_logf(SOAPY_SDR_ERROR, "Recorder: %s.sigmf-data: %s, recording stopped",
+                          d_path.c_str(), strerror(errno));
+            return false;
+        }
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+void Recorder::writeMeta()
+{
+    const std::string metaPath = d_path + ".sigmf-meta";
+    FILE *f = fopen(metaPath.c_str(), "w");
+    if (f == nullptr) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "Recorder: %s: %s", metaPath.c_str(), strerror(errno));
+        return;
+    }
+    
+    fprintf(f, "{\n");
+    fprintf(f, "    \"global\": {\n");
+    fprintf(f, "        \"core:datatype\": \"%s\",\n", d_datatype.c_str());
+    fprintf(f, "        \"core:sample_rate\": %.17g,\n", d_sample_rate);
+    fprintf(f, "        \"core:num_channels\": %zu,\n", d_channels / 2);
+    fprintf(f, "        \"core:hw\": \"TujaSDR\",\n");
+    fprintf(f, "        \"core:recorder\": \"SoapyTujaSDR\",\n");
+    fprintf(f, "        \"core:version\": \"1.0.0\"\n");
+    fprintf(f, "    },\n");
+    
+    // A segment for the start and one after every gap
+    fprintf(f, "    \"captures\": [\n");
+    fprintf(f, "        {\"core:sample_start\": 0, \"core:global_index\": 0, "
+            "\"core:frequency\": %.17g, \"core:datetime\": \"%s\"}",
+            d_frequency, d_datetime.c_str());
+    for (const Gap &gap : d_log) {
+        if (gap.offset == d_data->writeIndex()) {
+            continue;
+        }
+        fprintf(f, ",\n        {\"core:sample_start\": %" PRIu64 ", \"core:global_index\": %" PRIu64
+                ", \"core:frequency\": %.17g}", gap.offset, gap.index, d_frequency);
+    }
+    fprintf(f, "\n    ],\n");
+    
+    fprintf(f, "    \"annotations\": [");
+    for (size_t i = 0; i < d_log.size(); i++) {
+        const Gap &gap = d_log[i];
+        std::string comment = gap.overrun ? "ALSA overrun, samples lost" : "";
+        if (gap.dropped > 0) {
+            comment += (comment.empty() ? "" : ", ") + std::to_string(gap.dropped) +
+            " samples dropped, the disk fell behind";
+        }
+        fprintf(f, "%s\n        {\"core:sample_start\": %" PRIu64 ", \"core:comment\": \"%s\"}",
+                i == 0 ? "" : ",", gap.offset, comment.c_str());
+    }
+    fprintf(f, "%s]\n", d_log.empty() ? "" : "\n    ");
+    fprintf(f, "}\n");
+    
+    if (fclose(f) != 0) {
+        SoapySDR_logf(SOAPY_SDR_ERROR, "Recorder: %s: %s", metaPath.c_str(), strerror(errno));
+    }
+}
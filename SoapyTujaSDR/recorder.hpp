@@ -0,0 +1,111 @@
+//
+//  recorder.hpp
+//  SoapyTujaSDR
+//
+
+#pragma once
+
+#include <SoapySDR/ConverterRegistry.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ringbuffer.hpp"
+
+/*
+ Capture to disk as a SigMF recording, path.sigmf-data and
+ path.sigmf-meta.
+ 
+ The capture path copies every block it reads into a lock-free ring and
+ moves on, a writer thread woken for every blockBytes of output converts
+ and writes it out. A slow disk only ever fills the ring. When it's full
+ whole blocks are dropped, and the data that follows starts a new capture
+ segment whose core:global_index says where in the capture it belongs.
+ ALSA overruns, where samples were lost before they reached us, also start
+ a segment. Both are annotated. The metadata is written when the recording
+ stops.
+ */
+class Recorder
+{
+private:
+    // Where the data continues after a gap, passed over its own ring
+    struct Gap {
+        uint64_t offset;    // frames into the data file
+        uint64_t index;     // frames into the capture
+        uint64_t dropped;   // frames dropped here, by us
+        bool overrun;       // ALSA overran before this
+    };
+    
+    // Control side
+    mutable std::mutex d_control_mutex;
+    std::string d_path;
+    std::string d_format;
+    std::string d_datatype;
+    std::string d_datetime;
+    double d_sample_rate;
+    double d_frequency;
+    size_t d_channels;
+    size_t d_block_frames;  // captured frames in blockBytes of output
+    SoapySDR::ConverterRegistry::ConverterFunction d_converter;
+    
+    // Shared, the capture path only touches the rings while both flags
+    // say so, stop waits for it to leave
+    std::unique_ptr<RingBuffer> d_data;
+    std::unique_ptr<RingBuffer> d_gaps;
+    std::atomic<bool> d_active;
+    std::atomic<bool> d_pushing;
+    std::atomic<uint64_t> d_dropped;
+    
+    // Capture side
+    uint64_t d_captured;
+    uint64_t d_gap_dropped;
+    bool d_gap_overrun;
+    
+    // Writer side, d_event wakes it when a block is ready or to stop
+    std::thread d_thread;
+    std::atomic<bool> d_stop;
+    int d_event;
+    int d_fd;
+    std::vector<Gap> d_log;
+    
+    void wake();
+    void run();
+    bool writeData(const void *data, size_t bytes);
+    void writeMeta();
+
+public:
+    // Writes go out this big, at offsets that are multiples of it
+    static const size_t blockBytes = 1 << 20;
+    
+    Recorder();
+    ~Recorder();
+    
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+    
+    // Record CS32 frames of channels scalars as format (CS32, CS16, CS8,
+    // CU8, CF32 or CF64), stopping any recording first. Throws
+    // std::runtime_error if the format or files are no good.
+    void start(const std::string &path,
+               const std::string &format,
+               const double sampleRate,
+               const size_t channels,
+               const double frequency);
+    
+    // Write out what is queued and the metadata
+    void stop();
+    
+    // Base path of the recording, empty when not recording
+    std::string path() const;
+    
+    // Frames dropped since start because the disk fell behind
+    uint64_t dropped() const { return d_dropped.load(std::memory_order_relaxed); }
+    
+    // Capture side, from one thread at a time. Never blocks.
+    void push(const int32_t *frames, const size_t numFrames);
+    void overrun();
+};
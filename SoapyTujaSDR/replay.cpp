@@ -0,0 +1,196 @@
+//
+//  replay.cpp
+//  SoapyTujaSDR
+//
+
+#include "replay.hpp"
+#include <SoapySDR/Formats.hpp>
+#include <SoapySDR/Logger.hpp>
+#include <SoapySDR/Time.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// SoapySDR format of a SigMF datatype, the ones Recorder writes
+static std::string soapyFormat(const std::string &datatype)
+{
+    if (datatype == "ci32_le") {
+        return SOAPY_SDR_CS32;
+    }
+    if (datatype == "ci16_le") {
+        return SOAPY_SDR_CS16;
+    }
+    if (datatype == "ci8") {
+        return SOAPY_SDR_CS8;
+    }
+    if (datatype == "cu8") {
+        return SOAPY_SDR_CU8;
+    }
+    if (datatype == "cf32_le") {
+        return SOAPY_SDR_CF32;
+    }
+    if (datatype == "cf64_le") {
+        return SOAPY_SDR_CF64;
+    }
+    return "";
+}
+
+// First value of key in the metadata, enough JSON for what we need. The
+// first core:frequency is the first capture's.
+static std::string metaValue(const std::string &meta, const std::string &key)
+{
+    const std::string quoted = "\"" + key + "\"";
+    size_t pos = meta.find(quoted);
+    if (pos == std::string::npos or
+        (pos = meta.find(':', pos + quoted.size())) == std::string::npos or
+        (pos = meta.find_first_not_of(" \t\r\n", pos + 1)) == std::string::npos) {
+        return "";
+    }
+    if (meta[pos] == '"') {
+        const size_t end = meta.find('"', pos + 1);
+        return end == std::string::npos ? "" : meta.substr(pos + 1, end - pos - 1);
+    }
+    const size_t end = meta.find_first_of(",}] \t\r\n", pos);
+    return meta.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+}
+
+static long long monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleepUntilNs(const long long ns)
+{
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+}
+
+Replay::Replay(const std::string &path, const bool fast, const bool loop) :
+d_data(nullptr),
+d_bytes(0),
+d_frame_size(0),
+d_frames(0),
+d_sample_rate(0),
+d_frequency(0),
+d_fast(fast),
+d_loop(loop),
+d_index(0),
+d_start_ns(0)
+{
+    std::string base = path;
+    for (const std::string ext : {".sigmf-data", ".sigmf-meta"}) {
+        if (base.size() > ext.size() and base.compare(base.size() - ext.size(), ext.size(), ext) == 0) {
+            base.resize(base.size() - ext.size());
+        }
+    }
+    const std::string dataPath = base + ".sigmf-data";
+    const std::string metaPath = base + ".sigmf-meta";
+    
+    std::ifstream metaFile(metaPath);
+    if (not metaFile) {
+        throw std::runtime_error("Replay: can't read " + metaPath);
+    }
+    std::stringstream meta;
+    meta << metaFile.rdbuf();
+    
+    const std::string datatype = metaValue(meta.str(), "core:datatype");
+    d_format = soapyFormat(datatype);
+    if (d_format.empty()) {
+        throw std::runtime_error("Replay: can't play core:datatype " + datatype);
+    }
+    const std::string channels = metaValue(meta.str(), "core:num_channels");
+    if (not channels.empty() and channels != "1") {
+        throw std::runtime_error("Replay: can't play core:num_channels " + channels);
+    }
+    d_sample_rate = std::atof(metaValue(meta.str(), "core:sample_rate").c_str());
+    if (d_sample_rate <= 0) {
+        throw std::runtime_error("Replay: no core:sample_rate in " + metaPath);
+    }
+    d_frequency = std::atof(metaValue(meta.str(), "core:frequency").c_str());
+    
+    const int fd = open(dataPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Replay: " + dataPath + ": " + std::string(strerror(errno)));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw std::runtime_error("Replay: fstat " + std::string(strerror(errno)));
+    }
+    d_frame_size = SoapySDR::formatToSize(d_format);
+    d_frames = st.st_size / d_frame_size;
+    if (d_frames == 0) {
+        close(fd);
+        throw std::runtime_error("Replay: " + dataPath + " is empty");
+    }
+    d_bytes = st.st_size;
+    void *data = mmap(nullptr, d_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Replay: mmap " + std::string(strerror(errno)));
+    }
+    // read ahead aggressively, drop behind
+    madvise(data, d_bytes, MADV_SEQUENTIAL);
+    d_data = (const uint8_t *) data;
+    
+    SoapySDR_logf(SOAPY_SDR_INFO, "Replay: %s, %llu frames of %s at %g Hz",
+                  dataPath.c_str(), (unsigned long long) d_frames, d_format.c_str(), d_sample_rate);
+}
+
+Replay::~Replay()
+{
+    munmap((void *) d_data, d_bytes);
+}
+
+long long Replay::frameTimeNs(const uint64_t index) const
+{
+    return d_start_ns + SoapySDR::ticksToTimeNs((long long) index, d_sample_rate);
+}
+
+void Replay::start()
+{
+    d_start_ns = monotonicNs() - SoapySDR::ticksToTimeNs((long long) d_index, d_sample_rate);
+}
+
+size_t Replay::next(const size_t maxFrames, const long timeoutUs, const void *&data)
+{
+    const long long deadline = monotonicNs() + timeoutUs * 1000LL;
+    
+    if (atEnd()) {
+        sleepUntilNs(deadline);
+        return 0;
+    }
+    // Never across the end of the file, a loop starts over next time
+    const uint64_t offset = d_index % d_frames;
+    size_t frames = (size_t) std::min<uint64_t>(maxFrames, d_frames - offset);
+    if (not d_fast) {
+        // A block is there once its last frame has played
+        if (frameTimeNs(d_index + frames) > deadline) {
+            sleepUntilNs(deadline);
+            const uint64_t played = SoapySDR::timeNsToTicks(deadline - d_start_ns, d_sample_rate);
+            frames = played > d_index ? (size_t) std::min<uint64_t>(frames, played - d_index) : 0;
+            if (frames == 0) {
+                return 0;
+            }
+        } else {
+            sleepUntilNs(frameTimeNs(d_index + frames));
+        }
+    }
+    data = d_data + offset * d_frame_size;
+    d_index += frames;
+    return frames;
+}
@@ -0,0 +1,64 @@
+//
+//  replay.hpp
+//  SoapyTujaSDR
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ A SigMF recording played back in place of the capture, see Recorder.
+ 
+ The data file is mapped and handed out block by block straight from the
+ mapping, in the recording's format. Blocks are paced to the recording's
+ sample rate like a live capture, or come as fast as they are asked for.
+ */
+class Replay
+{
+private:
+    const uint8_t *d_data;
+    size_t d_bytes;
+    size_t d_frame_size;
+    uint64_t d_frames;
+    std::string d_format;
+    double d_sample_rate;
+    double d_frequency;
+    const bool d_fast;
+    const bool d_loop;
+    
+    uint64_t d_index;       // frames handed out, keeps counting when looping
+    long long d_start_ns;   // CLOCK_MONOTONIC when frame 0 played
+    
+    long long frameTimeNs(const uint64_t index) const;
+
+public:
+    // path is the .sigmf-data or .sigmf-meta file or the name without
+    // either. Throws std::runtime_error if the recording can't be played.
+    Replay(const std::string &path, const bool fast, const bool loop);
+    ~Replay();
+    
+    Replay(const Replay&) = delete;
+    Replay& operator=(const Replay&) = delete;
+    
+    // SoapySDR format of the data, one complex channel
+    const std::string &format() const { return d_format; }
+    double sampleRate() const { return d_sample_rate; }
+    double frequency() const { return d_frequency; }
+    
+    // Pace from now on, frames already handed out count as played
+    void start();
+    
+    // Up to maxFrames of the recording. In real time waits up to
+    // timeoutUs for them to play and returns what has by then. Returns 0
+    // on timeout, and at the end after waiting out the timeout.
+    size_t next(const size_t maxFrames, const long timeoutUs, const void *&data);
+    
+    // CLOCK_MONOTONIC time of the next frame next() returns
+    long long timeNs() const { return frameTimeNs(d_index); }
+    
+    // Played to the end, never when looping
+    bool atEnd() const { return not d_loop and d_index >= d_frames; }
+};
@@ -0,0 +1,85 @@
+//
+//  ringbuffer.cpp
+//  SoapyTujaSDR
+//
+
+#include "ringbuffer.hpp"
+#include "realtime.h"
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+RingBuffer::RingBuffer(size_t frames, size_t frame_size) :
+d_base(nullptr),
+d_size(0),
+d_frame_size(frame_size),
+d_capacity(0),
+d_head(0),
+d_pad(),
+d_tail(0)
+{
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    
+    // Power of two number of bytes so the indices can be masked, and at
+    // least one page since that's the mapping granularity.
+    d_size = page_size;
+    while (d_size < frames * frame_size) {
+        d_size <<= 1;
+    }
+    if (d_size % frame_size != 0) {
+        throw std::runtime_error("RingBuffer: frame size must divide page size");
+    }
+    d_capacity = d_size / frame_size;
+    if ((d_capacity & (d_capacity - 1)) != 0) {
+        throw std::runtime_error("RingBuffer: frame size must be a power of two");
+    }
+    
+    int fd = memfd_create("tujasdr-ring", MFD_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("RingBuffer: memfd_create " + std::string(strerror(errno)));
+    }
+    if (ftruncate(fd, d_size) < 0) {
+        close(fd);
+        throw std::runtime_error("RingBuffer: ftruncate " + std::string(strerror(errno)));
+    }
+    
+    // Reserve twice the address space then map the same pages into both halves
+    void *base = mmap(nullptr, 2 * d_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("RingBuffer: mmap " + std::string(strerror(errno)));
+    }
+    d_base = (uint8_t *) base;
+    
+    if (mmap(d_base, d_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED or
+        mmap(d_base + d_size, d_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        int err = errno;
+        munmap(d_base, 2 * d_size);
+        close(fd);
+        throw std::runtime_error("RingBuffer: mmap " + std::string(strerror(err)));
+    }
+    
+    // The mappings keep the memory alive
+    close(fd);
+}
+
+RingBuffer::~RingBuffer()
+{
+    munmap(d_base, 2 * d_size);
+}
+
+void RingBuffer::reset()
+{
+    d_head.store(0);
+    d_tail.store(0);
+}
+
+int RingBuffer::lock()
+{
+    return rt_lock_memory(d_base, 2 * d_size);
+}
@@ -0,0 +1,83 @@
+//
+//  ringbuffer.hpp
+//  SoapyTujaSDR
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ Single producer single consumer lock-free ring buffer.
+ 
+ The backing memory is mapped twice, back to back, in virtual memory so
+ any region up to the capacity is contiguous even when it wraps. This lets
+ ALSA read straight into the ring and the converters read straight out of
+ it without splitting at the wrap point.
+ */
+class RingBuffer
+{
+private:
+    uint8_t *d_base;
+    size_t d_size;          // bytes, one mapping
+    const size_t d_frame_size;
+    size_t d_capacity;      // frames, power of two
+    
+    // Monotonic frame counters, only ever written by one side. Padded
+    // apart so producer and consumer don't share a cache line.
+    std::atomic<uint64_t> d_head; // producer
+    uint8_t d_pad[64];
+    std::atomic<uint64_t> d_tail; // consumer
+    
+public:
+    RingBuffer(size_t frames, size_t frame_size);
+    ~RingBuffer();
+    
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+    
+    size_t capacity() const { return d_capacity; }
+    size_t frameSize() const { return d_frame_size; }
+    
+    // Producer side
+    size_t writeAvailable() const
+    {
+        return d_capacity - (size_t)(d_head.load(std::memory_order_relaxed) -
+                                     d_tail.load(std::memory_order_acquire));
+    }
+    void *writePtr() const
+    {
+        return d_base + (d_head.load(std::memory_order_relaxed) & (d_capacity - 1)) * d_frame_size;
+    }
+    void commitWrite(size_t frames)
+    {
+        d_head.store(d_head.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+    }
+    // Frames written so far, sample index of the next write
+    uint64_t writeIndex() const { return d_head.load(std::memory_order_relaxed); }
+    
+    // Consumer side
+    size_t readAvailable() const
+    {
+        return (size_t)(d_head.load(std::memory_order_acquire) -
+                        d_tail.load(std::memory_order_relaxed));
+    }
+    const void *readPtr() const
+    {
+        return d_base + (d_tail.load(std::memory_order_relaxed) & (d_capacity - 1)) * d_frame_size;
+    }
+    void commitRead(size_t frames)
+    {
+        d_tail.store(d_tail.load(std::memory_order_relaxed) + frames, std::memory_order_release);
+    }
+    // Frames consumed so far, sample index of the next read
+    uint64_t readIndex() const { return d_tail.load(std::memory_order_relaxed); }
+    
+    // Only call when neither side is running
+    void reset();
+    
+    // mlock and prefault both mappings, returns 0 or -errno
+    int lock();
+};
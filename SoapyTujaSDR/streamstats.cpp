@@ -0,0 +1,75 @@
+//
+//  streamstats.cpp
+//  SoapyTujaSDR
+//
+
+#include "streamstats.hpp"
+#include <cinttypes>
+#include <cstdio>
+
+uint64_t Histogram::percentile(const double p) const
+{
+    const uint64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+    
+    const uint64_t target = (uint64_t)(p * total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < numBuckets; i++) {
+        seen += d_buckets[i].load(std::memory_order_relaxed);
+        if (seen > target) {
+            return i == 0 ? 0 : 1ULL << i;
+        }
+    }
+    return d_max.load(std::memory_order_relaxed);
+}
+
+std::string Histogram::toString() const
+{
+    char line[128];
+    const uint64_t total = count();
+    const uint64_t sum = d_sum.load(std::memory_order_relaxed);
+    
+    snprintf(line, sizeof(line),
+             "count=%" PRIu64 " mean_ns=%" PRIu64 " max_ns=%" PRIu64
+             " p50_ns=%" PRIu64 " p90_ns=%" PRIu64 " p99_ns=%" PRIu64 " buckets=",
+             total, total ? sum / total : 0, d_max.load(std::memory_order_relaxed),
+             percentile(0.5), percentile(0.9), percentile(0.99));
+    
+    std::string result(line);
+    // Trailing empty buckets carry no information
+    size_t last = numBuckets;
+    while (last > 0 and d_buckets[last - 1].load(std::memory_order_relaxed) == 0) {
+        last--;
+    }
+    for (size_t i = 0; i < last; i++) {
+        if (i > 0) {
+            result += ",";
+        }
+        result += std::to_string(d_buckets[i].load(std::memory_order_relaxed));
+    }
+    return result;
+}
+
+void Histogram::reset()
+{
+    for (size_t i = 0; i < numBuckets; i++) {
+        d_buckets[i].store(0, std::memory_order_relaxed);
+    }
+    d_count.store(0, std::memory_order_relaxed);
+    d_sum.store(0, std::memory_order_relaxed);
+    d_max.store(0, std::memory_order_relaxed);
+}
+
+void StreamStats::reset()
+{
+    samples.store(0, std::memory_order_relaxed);
+    xruns.store(0, std::memory_order_relaxed);
+    recover_failures.store(0, std::memory_order_relaxed);
+    fill.store(0, std::memory_order_relaxed);
+    inserted.store(0, std::memory_order_relaxed);
+    wait.reset();
+    transfer.reset();
+    convert.reset();
+}
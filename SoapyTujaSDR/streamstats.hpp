@@ -0,0 +1,87 @@
+//
+//  streamstats.hpp
+//  SoapyTujaSDR
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ Always on streaming health counters, read as sensors.
+ 
+ Every counter has a single writer, the thread doing the streaming, so
+ relaxed atomics are enough and a sample costs an uncontended add.
+ Readers may see counters from slightly different moments, that's fine
+ for monitoring.
+ */
+
+// Log2 histogram of durations in nanoseconds. Bucket i counts durations
+// in [2^(i-1), 2^i), bucket 0 is zero.
+class Histogram
+{
+public:
+    static const size_t numBuckets = 40; // up to ~18 minutes
+
+private:
+    std::atomic<uint64_t> d_buckets[numBuckets];
+    std::atomic<uint64_t> d_count;
+    std::atomic<uint64_t> d_sum;
+    std::atomic<uint64_t> d_max;
+
+public:
+    Histogram() { reset(); }
+    
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+    
+    void add(const uint64_t ns)
+    {
+        size_t bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+        if (bucket >= numBuckets) {
+            bucket = numBuckets - 1;
+        }
+        d_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        d_count.fetch_add(1, std::memory_order_relaxed);
+        d_sum.fetch_add(ns, std::memory_order_relaxed);
+        if (ns > d_max.load(std::memory_order_relaxed)) {
+            d_max.store(ns, std::memory_order_relaxed);
+        }
+    }
+    
+    uint64_t count() const { return d_count.load(std::memory_order_relaxed); }
+    
+    // Upper bound of the bucket holding the p quantile
+    uint64_t percentile(const double p) const;
+    
+    // count, mean, max, percentiles and the raw buckets on one line
+    std::string toString() const;
+    
+    void reset();
+};
+
+struct StreamStats
+{
+    std::atomic<uint64_t> samples;          // frames handed to or taken from the client
+    std::atomic<uint64_t> xruns;            // overflows (RX) or underflows (TX)
+    std::atomic<uint64_t> recover_failures; // snd_pcm_recover gave up
+    std::atomic<uint64_t> fill;             // frames queued in the ALSA buffer, last seen
+    std::atomic<uint64_t> inserted;         // frames of silence played in place of late samples (TX)
+    Histogram wait;                         // time blocked in snd_pcm_wait
+    Histogram transfer;                     // time in snd_pcm_readi/writei
+    Histogram convert;                      // time in the format converter
+    
+    StreamStats() { reset(); }
+    
+    void reset();
+    
+    static uint64_t nowNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
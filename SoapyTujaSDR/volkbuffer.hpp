@@ -0,0 +1,78 @@
+//
+//  volkbuffer.hpp
+//  SoapyTujaSDR
+//
+
+#pragma once
+
+#include <volk/volk.h>
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include "realtime.h"
+
+// Buffer from volk_malloc, aligned so VOLK can pick its _a kernels
+template <typename T>
+class VolkBuffer
+{
+private:
+    T *d_data;
+    size_t d_size;
+    bool d_locked;
+    
+    void release()
+    {
+        if (d_locked) {
+            rt_unlock_memory(d_data, d_size * sizeof(T));
+        }
+        volk_free(d_data);
+        d_data = nullptr;
+        d_size = 0;
+    }
+    
+public:
+    VolkBuffer() : d_data(nullptr), d_size(0), d_locked(false) {}
+    ~VolkBuffer() { release(); }
+    
+    VolkBuffer(const VolkBuffer&) = delete;
+    VolkBuffer& operator=(const VolkBuffer&) = delete;
+    
+    // Resize and fill, like std::vector::assign. The fill touches every
+    // page, a locked buffer stays locked, best effort.
+    void assign(size_t size, const T &value)
+    {
+        if (size != d_size) {
+            release();
+            if (size > 0) {
+                d_data = static_cast<T*>(volk_malloc(size * sizeof(T), volk_get_alignment()));
+                if (d_data == nullptr) {
+                    throw std::bad_alloc();
+                }
+                if (d_locked) {
+                    rt_lock_memory(d_data, size * sizeof(T));
+                }
+            }
+            d_size = size;
+        }
+        std::fill(d_data, d_data + d_size, value);
+    }
+    
+    // Lock in memory and prefault, now and after every resize, so a
+    // rate change on the streaming thread doesn't page fault later.
+    // Returns 0 or -errno like rt_lock_memory.
+    int setLocked(const bool locked)
+    {
+        if (locked == d_locked) {
+            return 0;
+        }
+        d_locked = locked;
+        return locked ? rt_lock_memory(d_data, d_size * sizeof(T)) :
+        rt_unlock_memory(d_data, d_size * sizeof(T));
+    }
+    
+    T *data() { return d_data; }
+    const T *data() const { return d_data; }
+    size_t size() const { return d_size; }
+    T &operator[](size_t i) { return d_data[i]; }
+    const T &operator[](size_t i) const { return d_data[i]; }
+};